@@ -0,0 +1,123 @@
+# Module benchmark run by make bench against the ChartDirector stub, so
+# only dispatch, data parsing, registry and GC costs are measured.
+# Results are printed as "bench name value unit" lines.
+#
+#   bench.tcl ?-charts 10000? ?-points 1000000? ?-threads 32? ?-calls 100000?
+
+array set opts {-charts 10000 -points 1000000 -threads 32 -calls 100000}
+array set opts $argv
+
+proc result { name value unit } {
+    puts [format "bench %-28s %12.3f %s" $name $value $unit]
+}
+
+# Prints per phase average of the module counters and resets them
+proc phases { prefix } {
+    array set stats [ns_chartdir stats -reset]
+    foreach phase {dispatch parse layout encode return} {
+        if { $stats(${phase}_count) > 0 } {
+            result $prefix.$phase [expr {double($stats(${phase}_usec)) / $stats(${phase}_count)}] usec/op
+        }
+    }
+    result $prefix.shard_busy $stats(shard_busy) times
+    result $prefix.lock_busy $stats(lock_busy) times
+}
+
+# Same chart as test/multiline.tcl
+set multiline {
+    set chart [ns_chartdir create xy 500 300]
+    ns_chartdir setbackground $chart 0xffff80 0 1
+    ns_chartdir setplotarea $chart 55 45 420 210 0xffffff -1 -1 0xc0c0c0 -1
+    ns_chartdir addlegend $chart 55 25 0 Transparent Transparent "" 8 TextColor
+    ns_chartdir addtitle $chart "Daily Server Load" Top "" 11 0xffffff 0x800000 -1 1
+    ns_chartdir yaxis $chart settitle "MBytes"
+    ns_chartdir xaxis $chart setlabels {0 "" "" 3 "" "" 6 "" "" 9 "" "" 12 "" "" 15 "" "" 18 "" "" 21 "" "" 24}
+    ns_chartdir xaxis $chart settitle "Jun 12, 2001"
+    ns_chartdir layer $chart create line {42 49 33 38 51 46 29 41 44 57 59 52 37 34 51 56 56 60 70 76 63 67 75 64 51} "Server # 1"
+    ns_chartdir layer $chart dataset 0 {50 55 47 34 42 49 63 62 73 59 56 50 64 60 67 67 58 59 73 77 84 82 80 84 98} "Server # 2"
+    ns_chartdir layer $chart dataset 0 {36 28 25 33 38 20 22 30 25 33 30 24 28 15 21 26 46 42 48 45 43 52 64 60 70} "Server # 3"
+    ns_chartdir layer $chart setlinewidth 0 3
+    ns_chartdir image $chart
+    ns_chartdir destroy $chart
+}
+
+ns_chartdir stats -reset
+
+# Dispatch: cheap subcommand through cached handle and through chart id
+set chart [ns_chartdir create xy 100 100]
+result dispatch.handle [lindex [time { ns_chartdir setsize $chart 100 100 } $opts(-calls)] 0] usec/call
+result dispatch.id [lindex [time { ns_chartdir setsize [format %d $chart] 100 100 } $opts(-calls)] 0] usec/call
+ns_chartdir destroy $chart
+phases dispatch
+
+# Parse: one series of -points values as numeric list, string and packed doubles
+set values {}
+for { set i 0 } { $i < $opts(-points) } { incr i } {
+    lappend values [expr {sin($i / 100.0) * 100.0}]
+}
+set string [join $values " "]
+set binary [binary format d* $values]
+foreach { name script } {
+    list { ns_chartdir layer $chart create line $values }
+    string { ns_chartdir layer $chart create line $string }
+    binary { ns_chartdir layer $chart create -binary float64 line $binary }
+} {
+    set chart [ns_chartdir create xy 1000 500]
+    set usec [lindex [time $script] 0]
+    ns_chartdir destroy $chart
+    result parse.$name [expr {$usec * 1000.0 / $opts(-points)}] nsec/point
+}
+unset values string binary
+phases parse
+
+# Registry: create, lookup by id and destroy of -charts live charts
+set charts {}
+set usec [lindex [time { lappend charts [ns_chartdir create xy 100 100] } $opts(-charts)] 0]
+result registry.create $usec usec/chart
+set ids {}
+foreach chart $charts {
+    lappend ids [format %d $chart]
+}
+set start [clock microseconds]
+foreach id $ids {
+    ns_chartdir setsize $id 100 100
+}
+result registry.lookup [expr {double([clock microseconds] - $start) / $opts(-charts)}] usec/chart
+set start [clock microseconds]
+foreach chart $charts {
+    ns_chartdir destroy $chart
+}
+result registry.destroy [expr {double([clock microseconds] - $start) / $opts(-charts)}] usec/chart
+unset charts ids
+phases registry
+
+# GC: -charts charts left idle longer than idle_timeout
+for { set i 0 } { $i < $opts(-charts) } { incr i } {
+    ns_chartdir create xy 100 100
+}
+after 2100
+set start [clock microseconds]
+set freed [ns_chartdir gc]
+set usec [expr {[clock microseconds] - $start}]
+result gc.freed $freed charts
+result gc.pass [expr {$usec / 1000.0}] msec
+result gc.chart [expr {$freed ? double($usec) / $freed : 0}] usec/chart
+phases gc
+
+# Threads: multiline chart built and encoded by 1 to -threads threads
+set count [expr {$opts(-calls) / 100}]
+for { set threads 1 } { $threads <= $opts(-threads) } { set threads [expr {$threads * 2}] } {
+    set tids {}
+    set start [clock microseconds]
+    for { set i 0 } { $i < $threads } { incr i } {
+        lappend tids [ns_thread begin "for {set i 0} {\$i < $count} {incr i} { $multiline }"]
+    }
+    foreach tid $tids {
+        ns_thread wait $tid
+    }
+    set usec [expr {[clock microseconds] - $start}]
+    result threads.$threads [expr {$threads * $count * 1000000.0 / $usec}] charts/sec
+    phases threads.$threads
+}
+
+ns_shutdown
@@ -0,0 +1,341 @@
+/*
+ * ChartDirector stand-in used by make bench
+ *
+ * Implements the part of the ChartDirector API used by nschartdir.c.
+ * Calls are counted and do nothing, images are fixed size buffers, so
+ * benchmarks measure the module itself without rendering.
+ */
+
+#ifndef CHARTDIR_STUB_H
+#define CHARTDIR_STUB_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+
+#ifndef CHARTDIR_STUB_IMAGE
+#define CHARTDIR_STUB_IMAGE 16384
+#endif
+
+enum Alignment { TopLeft = 7, TopCenter = 8, Top = 8, TopRight = 9, Left = 4, Center = 5, Right = 6,
+    BottomLeft = 1, BottomCenter = 2, Bottom = 2, BottomRight = 3
+};
+enum SymbolType { NoSymbol, SquareSymbol };
+enum { PNG, GIF, JPG, WMP, BMP, SVG, SVGZ };
+enum { Transparent = (int) 0xff000000, Palette = (int) 0xffff0000, BackgroundColor = (int) 0xffff0000,
+    LineColor = (int) 0xffff0001, TextColor = (int) 0xffff0002, DataColor = (int) 0xffff0008,
+    SameAsMainColor = (int) 0xffff0007
+};
+
+const double NoValue = 1.7E+308;
+const int defaultPalette[] = { 0xffffff, 0x000000, 0x000000, -1 };
+const int whiteOnBlackPalette[] = { 0x000000, 0xffffff, 0xffffff, -1 };
+const int transparentPalette[] = { 0xffffff, 0x000000, 0x000000, -1 };
+const int goldGradient[] = { 0, 0xffe743, 0x60, 0xffffe0, 0xb0, 0xfff0b0, 0x100, 0xffe743 };
+const int silverGradient[] = { 0, 0xc8c8c8, 0x60, 0xf8f8f8, 0xb0, 0xe0e0e0, 0x100, 0xc8c8c8 };
+const int redMetalGradient[] = { 0, 0xe09898, 0x60, 0xffe0e0, 0xb0, 0xf0d0d0, 0x100, 0xe09898 };
+const int blueMetalGradient[] = { 0, 0x9898e0, 0x60, 0xe0e0ff, 0xb0, 0xd0d0f0, 0x100, 0x9898e0 };
+const int greenMetalGradient[] = { 0, 0x98e098, 0x60, 0xe0ffe0, 0xb0, 0xd0f0d0, 0x100, 0x98e098 };
+
+// Number of API calls, reported on exit
+struct ChartStub {
+    unsigned long calls;
+    unsigned long charts;
+    unsigned long images;
+    unsigned long points;
+    char image[CHARTDIR_STUB_IMAGE];
+    ~ChartStub() {
+        fprintf(stderr, "chartdir stub: %lu calls, %lu charts, %lu images, %lu points\n",
+                calls, charts, images, points);
+    }
+};
+static ChartStub chartStub;
+
+#define STUB_CALL           __atomic_add_fetch(&chartStub.calls, 1, __ATOMIC_RELAXED)
+#define STUB_COUNT(f, n)    __atomic_add_fetch(&chartStub.f, n, __ATOMIC_RELAXED)
+
+struct MemBlock {
+    const char *data;
+    int len;
+    MemBlock(const char *d = 0, int l = 0):data(d), len(l) {}
+};
+struct DoubleArray {
+    const double *data;
+    int len;
+    DoubleArray(const double *d = 0, int l = 0):data(d), len(l) {}
+};
+struct IntArray {
+    const int *data;
+    int len;
+    IntArray(const int *d = 0, int l = 0):data(d), len(l) {}
+};
+struct StringArray {
+    const char *const *data;
+    int len;
+    StringArray(const char *const *d = 0, int l = 0):data(d), len(l) {}
+};
+
+static inline MemBlock stubOut()
+{
+    STUB_CALL;
+    STUB_COUNT(images, 1);
+    return MemBlock(chartStub.image, CHARTDIR_STUB_IMAGE);
+}
+
+static inline bool stubFile(const char *file)
+{
+    FILE *fp = fopen(file, "wb");
+
+    STUB_CALL;
+    STUB_COUNT(images, 1);
+    if (!fp)
+        return false;
+    fwrite(chartStub.image, 1, CHARTDIR_STUB_IMAGE, fp);
+    return fclose(fp) == 0;
+}
+
+class TextBox {
+  public:
+    void setBackground(int, int = -1, int = 0) { STUB_CALL; }
+    void setFontColor(int) { STUB_CALL; }
+    void setAlignment(Alignment) { STUB_CALL; }
+    void setFontAngle(double, bool = false) { STUB_CALL; }
+};
+
+class LegendBox:public TextBox {
+};
+
+class Mark:public TextBox {
+  public:
+    void setLineWidth(int) { STUB_CALL; }
+    void setMarkColor(int, int = -1, int = -1) { STUB_CALL; }
+    void setDrawOnTop(bool) { STUB_CALL; }
+};
+
+class DataSet {
+  public:
+    void setDataName(const char *) { STUB_CALL; }
+    void setDataSymbol(SymbolType, int = 5, int = -1, int = -1) { STUB_CALL; }
+    void setDataSymbol(const char *) { STUB_CALL; }
+    void setDataColor(int, int = -1, int = -1, int = -1) { STUB_CALL; }
+};
+
+class Layer {
+    DataSet dataset;
+    TextBox label;
+  public:
+    void set3D(int = -1, int = 0) { STUB_CALL; }
+    void setLineWidth(int) { STUB_CALL; }
+    void setBorderColor(int, int = 0) { STUB_CALL; }
+    void setDataCombineMethod(int) { STUB_CALL; }
+    void setXData(DoubleArray) { STUB_CALL; }
+    DataSet *addDataSet(int n, const double *, int = -1, const char * = 0) {
+        STUB_CALL;
+        STUB_COUNT(points, n);
+        return &dataset;
+    }
+    DataSet *addDataSet(DoubleArray data, int = -1, const char * = 0) {
+        STUB_CALL;
+        STUB_COUNT(points, data.len);
+        return &dataset;
+    }
+    DataSet *getDataSet(int) { STUB_CALL; return &dataset; }
+    TextBox *setDataLabelStyle(const char * = 0, double = 8, int = TextColor, double = 0) {
+        STUB_CALL;
+        return &label;
+    }
+    TextBox *setAggregateLabelStyle(const char * = 0, double = 8, int = TextColor, double = 0) {
+        STUB_CALL;
+        return &label;
+    }
+};
+
+class BarLayer:public Layer {
+  public:
+    void setBarGap(double, double = 0.2) { STUB_CALL; }
+};
+
+class LineLayer:public Layer {
+  public:
+    void setGapColor(int, int = -1) { STUB_CALL; }
+};
+
+class AreaLayer:public Layer {
+};
+
+class TrendLayer:public Layer {
+};
+
+class Axis {
+    TextBox title;
+    Mark mark;
+  public:
+    TextBox *setTitle(const char *, const char * = 0, double = 8, int = TextColor) {
+        STUB_CALL;
+        return &title;
+    }
+    TextBox *setLabelStyle(const char * = 0, double = 8, int = TextColor, double = 0) {
+        STUB_CALL;
+        return &title;
+    }
+    void setIndent(bool) { STUB_CALL; }
+    void setWidth(int) { STUB_CALL; }
+    void setLinearScale(double, double, double = 0) { STUB_CALL; }
+    void setLogScale(double, double, double = 0) { STUB_CALL; }
+    void setTickLength(int, int = 0) { STUB_CALL; }
+    void setTopMargin(int) { STUB_CALL; }
+    void setTickDensity(int, int = -1) { STUB_CALL; }
+    void setAutoScale(double = 0.1, double = 0.1, double = 0.8) { STUB_CALL; }
+    Mark *addMark(double, int, const char * = 0, const char * = 0, double = 8) { STUB_CALL; return &mark; }
+    void addZone(double, double, int) { STUB_CALL; }
+    void setLabelFormat(const char *) { STUB_CALL; }
+    void addLabel(double, const char *) { STUB_CALL; }
+};
+
+class XAxis:public Axis {
+};
+
+class YAxis:public Axis {
+};
+
+class PlotArea {
+  public:
+    void setBackground(const char *, int = Center) { STUB_CALL; }
+    void setBackground(int, int = -1, int = -1) { STUB_CALL; }
+};
+
+class DrawArea {
+    int width, height;
+  public:
+    DrawArea():width(0), height(0) {}
+    static DrawArea *create() { STUB_CALL; return new DrawArea(); }
+    void destroy() { STUB_CALL; delete this; }
+    MemBlock outPNG2() { return stubOut(); }
+    MemBlock outGIF2() { return stubOut(); }
+    MemBlock outJPG2(int = 80) { return stubOut(); }
+    MemBlock outWMP2() { return stubOut(); }
+    MemBlock outBMP2() { return stubOut(); }
+    bool outPNG(const char *file) { return stubFile(file); }
+    bool outGIF(const char *file) { return stubFile(file); }
+    bool outJPG(const char *file, int = 80) { return stubFile(file); }
+    bool outBMP(const char *file) { return stubFile(file); }
+    void setPaletteMode(int) { STUB_CALL; }
+    void setDitherMethod(int) { STUB_CALL; }
+    void load(const char *) { STUB_CALL; }
+    int getWidth() { STUB_CALL; return width; }
+    int getHeight() { STUB_CALL; return height; }
+    void merge(const DrawArea *, int, int, int, int) { STUB_CALL; }
+    void setSize(int w, int h, int = 0xffffff) { STUB_CALL; width = w; height = h; }
+};
+
+class BaseChart {
+    int width, height;
+    LegendBox legend;
+    TextBox text;
+    DrawArea area;
+  public:
+    BaseChart(int w, int h):width(w), height(h) { STUB_COUNT(charts, 1); }
+    virtual ~BaseChart() {}
+    void destroy() { STUB_CALL; delete this; }
+    void setBackground(int, int = -1, int = 0) { STUB_CALL; }
+    void setSize(int w, int h) { STUB_CALL; width = w; height = h; }
+    int getWidth() { STUB_CALL; return width; }
+    int getHeight() { STUB_CALL; return height; }
+    LegendBox *addLegend(int, int, bool = true, const char * = 0, double = 10) { STUB_CALL; return &legend; }
+    LegendBox *getLegend() { STUB_CALL; return &legend; }
+    TextBox *addTitle(Alignment, const char *, const char * = 0, double = 12, int = TextColor,
+                      int = Transparent, int = -1) {
+        STUB_CALL;
+        return &text;
+    }
+    TextBox *addText(int, int, const char *, const char * = 0, double = 8, int = TextColor,
+                     Alignment = TopLeft, double = 0, bool = false) {
+        STUB_CALL;
+        return &text;
+    }
+    void setBgImage(const char *, int = Center) { STUB_CALL; }
+    void setWallpaper(const char *) { STUB_CALL; }
+    void setColors(const int *) { STUB_CALL; }
+    int dashLineColor(int color, int) { STUB_CALL; return color; }
+    int patternColor(const int *, int, int, int = 0, int = 0) { STUB_CALL; return 0; }
+    int patternColor(const char *, int = 0, int = 0) { STUB_CALL; return 0; }
+    int gradientColor(const int *, double = 90, double = 1, int = 0, int = 0) { STUB_CALL; return 0; }
+    MemBlock makeChart(int) { return stubOut(); }
+    bool makeChart(const char *file) { return stubFile(file); }
+    DrawArea *makeChart() { STUB_CALL; area.setSize(width, height); return &area; }
+    void setSearchPath(const char *) { STUB_CALL; }
+    void setResource(const char *, MemBlock) { STUB_CALL; }
+    void setDefaultFonts(const char *, const char * = 0, const char * = 0, const char * = 0) { STUB_CALL; }
+    void setOutputOptions(const char *) { STUB_CALL; }
+};
+
+class XYChart:public BaseChart {
+    PlotArea plot;
+    XAxis x, x2;
+    YAxis y, y2;
+    LineLayer line;
+    BarLayer bar;
+    Layer area;
+    TrendLayer trend;
+  public:
+    XYChart(int w, int h):BaseChart(w, h) {}
+    static XYChart *create(int w, int h, int = 0xffffff, int = -1, int = 0) { STUB_CALL; return new XYChart(w, h); }
+    PlotArea *setPlotArea(int, int, int, int, int = Transparent, int = -1, int = LineColor,
+                          int = 0xc0c0c0, int = Transparent) {
+        STUB_CALL;
+        return &plot;
+    }
+    XAxis *xAxis() { STUB_CALL; return &x; }
+    XAxis *xAxis2() { STUB_CALL; return &x2; }
+    YAxis *yAxis() { STUB_CALL; return &y; }
+    YAxis *yAxis2() { STUB_CALL; return &y2; }
+    void syncYAxis(double = 1, double = 0) { STUB_CALL; }
+    void setYAxisOnRight(bool = true) { STUB_CALL; }
+    LineLayer *addLineLayer(int n, const double *, int = -1, const char * = 0) {
+        STUB_CALL;
+        STUB_COUNT(points, n);
+        return &line;
+    }
+    LineLayer *addLineLayer(DoubleArray data, int = -1, const char * = 0) {
+        STUB_CALL;
+        STUB_COUNT(points, data.len);
+        return &line;
+    }
+    BarLayer *addBarLayer(int n, const double *, const int *, const char *const *) {
+        STUB_CALL;
+        STUB_COUNT(points, n);
+        return &bar;
+    }
+    BarLayer *addBarLayer(DoubleArray data, IntArray) {
+        STUB_CALL;
+        STUB_COUNT(points, data.len);
+        return &bar;
+    }
+    BarLayer *addBarLayer(int n, const double *, int = -1, const char * = 0) {
+        STUB_CALL;
+        STUB_COUNT(points, n);
+        return &bar;
+    }
+    Layer *addAreaLayer(int n, const double *, int = -1, const char * = 0) {
+        STUB_CALL;
+        STUB_COUNT(points, n);
+        return &area;
+    }
+    TrendLayer *addTrendLayer(DoubleArray data, int = -1, const char * = 0) {
+        STUB_CALL;
+        STUB_COUNT(points, data.len);
+        return &trend;
+    }
+};
+
+class PieChart:public BaseChart {
+  public:
+    PieChart(int w, int h):BaseChart(w, h) {}
+    static PieChart *create(int w, int h, int = 0xffffff, int = -1, int = 0) { STUB_CALL; return new PieChart(w, h); }
+    void setData(int n, const double *, const char *const * = 0) { STUB_CALL; STUB_COUNT(points, n); }
+    void setData(DoubleArray data, StringArray) { STUB_CALL; STUB_COUNT(points, data.len); }
+    void set3D(int = -1, double = -1, bool = false) { STUB_CALL; }
+    void setPieSize(int, int, int) { STUB_CALL; }
+};
+
+#endif
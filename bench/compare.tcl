@@ -0,0 +1,44 @@
+# Compares two render.tcl results, run it with tclsh:
+#
+#   tclsh compare.tcl old.txt new.txt ?threshold?
+#
+# Prints change of every metric in percent, metrics which grew by more than
+# threshold percent, 10 by default, are marked and the exit code is 1.
+
+proc load { file } {
+    set fd [open $file]
+    foreach line [split [read $fd] \n] {
+        if { [lindex $line 0] eq "render" } {
+            set result([lindex $line 1]) [lrange $line 2 end]
+        }
+    }
+    close $fd
+    return [array get result]
+}
+
+if { [llength $argv] < 2 } {
+    puts stderr "usage: compare.tcl old new ?threshold?"
+    exit 2
+}
+array set old [load [lindex $argv 0]]
+array set new [load [lindex $argv 1]]
+set threshold [expr {[llength $argv] > 2 ? [lindex $argv 2] : 10}]
+set status 0
+
+foreach script [lsort [array names new]] {
+    if { ![info exists old($script)] } {
+        continue
+    }
+    foreach metric {build_usec make_usec bytes rss_kb} {
+        set a [dict get $old($script) $metric]
+        set b [dict get $new($script) $metric]
+        set diff [expr {$a > 0 ? ($b - $a) * 100.0 / $a : 0}]
+        set mark ""
+        if { $diff > $threshold } {
+            set mark " REGRESSION"
+            set status 1
+        }
+        puts [format "%-16s %-12s %12s %12s %+8.1f%%%s" $script $metric $a $b $diff $mark]
+    }
+}
+exit $status
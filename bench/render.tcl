@@ -0,0 +1,141 @@
+# Render benchmark run by make bench-render with the real ChartDirector.
+# Every chart script from test/ is run -runs times, ns_chartdir is wrapped
+# so chart size is multiplied by -scale, layer data is repeated up to
+# -points values and save writes nothing but renders the image in memory.
+#
+#   render.tcl ?-runs 20? ?-scale 1? ?-points 0? ?-output file? ?script ...?
+#
+# One line per script is printed or written to -output:
+#
+#   render script runs N scale S points P build_usec B make_usec M bytes N rss_kb R
+#
+# build_usec is time spent building charts, make_usec time spent in layout
+# and encoding, both per run, bytes is image size per run and rss_kb is peak
+# resident memory while the script runs. compare.tcl compares two results.
+
+array set opts {-runs 20 -scale 1 -points 0 -output ""}
+set scripts {}
+foreach { name value } $argv {
+    if { [string index $name 0] ne "-" } {
+        set scripts [lrange $argv [lsearch -exact $argv $name] end]
+        break
+    }
+    set opts($name) $value
+}
+
+set testdir [file normalize [file join [file dirname [info script]] .. test]]
+if { $scripts eq "" } {
+    foreach file [lsort [glob -directory $testdir *.tcl]] {
+        # Measurement, check and connection scripts, not charts
+        if { [lsearch -exact {async cache downsample formats handle registry webimage} [file rootname [file tail $file]]] == -1 } {
+            lappend scripts [file rootname [file tail $file]]
+        }
+    }
+}
+
+# Repeats numeric lists up to -points values
+proc resize { value } {
+    global opts
+    if { $opts(-points) <= 0 || [catch { llength $value } len] || $len < 2 } {
+        return $value
+    }
+    foreach item $value {
+        if { ![string is double -strict $item] } {
+            return $value
+        }
+    }
+    set list {}
+    for { set i 0 } { $i < $opts(-points) } { incr i } {
+        lappend list [lindex $value [expr {$i % $len}]]
+    }
+    return $list
+}
+
+rename ns_chartdir ns_chartdir_orig
+
+proc ns_chartdir { cmd args } {
+    global opts make bytes
+    switch -- $cmd {
+        create {
+            # Scale width and height, they follow optional -scope and -template
+            for { set i 0 } { $i < [llength $args] && [string index [lindex $args $i] 0] eq "-" } { incr i 2 } {}
+            foreach j [list [expr {$i + 1}] [expr {$i + 2}]] {
+                if { [string is integer -strict [lindex $args $j]] } {
+                    lset args $j [expr {int([lindex $args $j] * $opts(-scale))}]
+                }
+            }
+        }
+        layer {
+            if { [lsearch -exact {create dataset} [lindex $args 1]] != -1 } {
+                set list {}
+                foreach arg $args {
+                    lappend list [resize $arg]
+                }
+                set args $list
+            }
+        }
+        save {
+            set start [clock microseconds]
+            set image [ns_chartdir_orig image [lindex $args 0]]
+            set make [expr {$make + [clock microseconds] - $start}]
+            set bytes [expr {$bytes + [string length $image]}]
+            return
+        }
+        image - render {
+            set start [clock microseconds]
+            set image [uplevel 1 [list ns_chartdir_orig $cmd] $args]
+            set make [expr {$make + [clock microseconds] - $start}]
+            set bytes [expr {$bytes + [string length $image]}]
+            return $image
+        }
+    }
+    uplevel 1 [list ns_chartdir_orig $cmd] $args
+}
+
+# Peak RSS is reset by writing 5 to clear_refs
+proc rss { {reset 0} } {
+    if { $reset } {
+        catch {
+            set fd [open /proc/self/clear_refs w]
+            puts $fd 5
+            close $fd
+        }
+    }
+    set rss 0
+    catch {
+        set fd [open /proc/self/status]
+        regexp {VmHWM:\s+(\d+)} [read $fd] - rss
+        close $fd
+    }
+    return $rss
+}
+
+if { $opts(-output) ne "" } {
+    set out [open $opts(-output) w]
+} else {
+    set out stdout
+}
+
+cd $testdir
+foreach script $scripts {
+    set make 0
+    set bytes 0
+    rss 1
+    set start [clock microseconds]
+    for { set run 0 } { $run < $opts(-runs) } { incr run } {
+        namespace eval ::bench [list source $script.tcl]
+        namespace delete ::bench
+    }
+    set total [expr {[clock microseconds] - $start}]
+    puts $out [list render $script runs $opts(-runs) scale $opts(-scale) points $opts(-points) \
+                   build_usec [expr {($total - $make) / $opts(-runs)}] \
+                   make_usec [expr {$make / $opts(-runs)}] \
+                   bytes [expr {$bytes / $opts(-runs)}] \
+                   rss_kb [rss]]
+    flush $out
+}
+if { $out ne "stdout" } {
+    close $out
+}
+
+ns_shutdown
@@ -0,0 +1,140 @@
+# Stress test run by make stress against the ChartDirector stub. Threads,
+# each with its own interp, randomly create, build, render, destroy and
+# gc private charts and charts shared through nsv slots, which other
+# threads may destroy and replace at any time. Thread count is doubled
+# from 1 up to -threads, throughput and wait times of module mutexes are
+# printed for every step. Errors other than expired charts fail the run.
+#
+#   stress.tcl ?-threads 64? ?-seconds 5? ?-shared 64?
+
+array set opts {-threads 64 -seconds 5 -shared 64}
+array set opts $argv
+
+set worker {
+    set ops 0
+    set expired 0
+    set errors {}
+    set private {}
+    set data {42 49 33 38 51 46 29 41 44 57 59 52 37 34 51 56 56 60 70 76 63 67 75 64 51}
+    while { [clock milliseconds] < $deadline } {
+        set slot [expr {int(rand() * $shared)}]
+        set op [expr {int(rand() * 10)}]
+        if { $op < 5 } {
+            # Shared chart, use the id stored in the slot
+            set chart [nsv_get stress $slot]
+        } elseif { [llength $private] } {
+            set chart [lindex $private [expr {int(rand() * [llength $private])}]]
+        } else {
+            set chart [ns_chartdir create xy 200 100]
+            lappend private $chart
+        }
+        if { [catch {
+            switch [expr {int(rand() * 8)}] {
+                0 {
+                    if { $op < 5 } {
+                        nsv_set stress $slot [ns_chartdir create xy 200 100]
+                    } else {
+                        lappend private [ns_chartdir create xy 200 100]
+                    }
+                }
+                1 - 2 {
+                    ns_chartdir layer $chart create line $data
+                }
+                3 {
+                    ns_chartdir setplotarea $chart 20 20 160 60
+                    ns_chartdir xaxis $chart settitle "Time"
+                }
+                4 - 5 {
+                    ns_chartdir image $chart
+                }
+                6 {
+                    ns_chartdir destroy $chart
+                    if { $op < 5 } {
+                        nsv_set stress $slot [ns_chartdir create xy 200 100]
+                    } else {
+                        set private [lsearch -all -inline -not -exact $private $chart]
+                    }
+                }
+                7 {
+                    ns_chartdir gc
+                }
+            }
+        } msg] } {
+            if { [string match "Invalid or expired chart*" $msg] } {
+                incr expired
+                if { $op < 5 } {
+                    nsv_set stress $slot [ns_chartdir create xy 200 100]
+                } else {
+                    set private [lsearch -all -inline -not -exact $private $chart]
+                }
+            } else {
+                lappend errors $msg
+            }
+        }
+        incr ops
+    }
+    foreach chart $private {
+        catch { ns_chartdir destroy $chart }
+    }
+    list $ops $expired [lrange $errors 0 9]
+}
+
+# Module mutexes as name {nlock nbusy totalwait}
+proc locks {} {
+    set result {}
+    foreach lock [ns_info locks] {
+        if { [string match nschartdir* [lindex $lock 0]] } {
+            dict set result [lindex $lock 0] [lrange $lock 3 5]
+        }
+    }
+    return $result
+}
+
+set status 0
+for { set i 0 } { $i < $opts(-shared) } { incr i } {
+    nsv_set stress $i [ns_chartdir create xy 200 100]
+}
+
+for { set threads 1 } { $threads <= $opts(-threads) } { set threads [expr {$threads * 2}] } {
+    ns_chartdir stats -reset
+    set before [locks]
+    set deadline [expr {[clock milliseconds] + $opts(-seconds) * 1000}]
+    set tids {}
+    for { set i 0 } { $i < $threads } { incr i } {
+        lappend tids [ns_thread begin [list apply [list {deadline shared} $worker] $deadline $opts(-shared)]]
+    }
+    set ops 0
+    set expired 0
+    foreach tid $tids {
+        lassign [ns_thread wait $tid] n e errors
+        incr ops $n
+        incr expired $e
+        foreach msg $errors {
+            puts "stress error: $msg"
+            set status 1
+        }
+    }
+    puts [format "stress threads %-3d %12.0f ops/sec %8d expired" $threads \
+              [expr {$ops / double($opts(-seconds))}] $expired]
+    set after [locks]
+    foreach name [lsort [dict keys $after]] {
+        lassign [dict get $after $name] nlock nbusy wait
+        if { [dict exists $before $name] } {
+            lassign [dict get $before $name] nlock0 nbusy0 wait0
+            set nlock [expr {$nlock - $nlock0}]
+            set nbusy [expr {$nbusy - $nbusy0}]
+            set wait [expr {$wait - $wait0}]
+        }
+        if { $nlock > 0 } {
+            puts [format "stress   %-24s %10d locks %8d busy %12.6f sec wait" $name $nlock $nbusy $wait]
+        }
+    }
+    array set stats [ns_chartdir stats]
+    puts [format "stress   %-24s %10d busy" "chart locks" $stats(lock_busy)]
+}
+
+for { set i 0 } { $i < $opts(-shared) } { incr i } {
+    catch { ns_chartdir destroy [nsv_get stress $i] }
+}
+puts "stress [expr {$status ? "FAILED" : "passed"}]"
+ns_shutdown
@@ -34,9 +34,49 @@
  *      returns list with cusrrently opened charts as
  *         { id accesstime } ...
  *
+ *    ns_chartdir render spec ?-format format? ?-quality n? ?-blob? ?-return?
+ *      builds chart from the spec dict in one call and returns the image or
+ *      writes it to the connection if -return is given, chart is never
+ *      registered, spec keys are type, size and the names of ns_chartdir
+ *      subcommands with their arguments, see README
+ *
+ *    ns_chartdir blob size|type|return|write blob ?file?
+ *      image blob returned by image or render with -blob option keeps
+ *      a reference to the rendered image, blob commands use it without
+ *      copying
+ *
+ *    ns_chartdir schedule ?name interval ?script??
+ *      runs the script every interval seconds in a scheduler thread,
+ *      interval 0 cancels it, without arguments returns list of
+ *      scheduled scripts as { name interval } ...
+ *
+ *    ns_chartdir template define name script-or-spec
+ *    ns_chartdir template delete name
+ *    ns_chartdir template names
+ *      manages chart templates, commands applied by the script to the
+ *      chart it creates are recorded and replayed by create -template
+ *
+ *    ns_chartdir renderbatch {#chart ...} ?-format format? ?-quality n? ?-dir dir?
+ *      renders charts in parallel on the render pool, returns list of
+ *      image blobs or with -dir writes dir/id.format files and returns
+ *      list of file names
+ *
+ *    ns_chartdir composite {#chart ...} ?-columns n? ?-gap px? ?-bgcolor color?
+ *        ?-format format? ?-quality n? ?-blob?
+ *      draws charts in a grid into one image, returns list of the image
+ *      and tiles as { id x y width height } ...
+ *
+ *    ns_chartdir stats ?-reset?
+ *      returns module statistics and per phase timing as name value list
+ *
+ *    ns_chartdir pool
+ *      returns render thread pool statistics as name value list: threads,
+ *      queued, jobs and total and maximum queue wait and render time
+ *
  *    ns_chartdir gc
  *      performs garbage collection, closes inactive charts according to
- *      config parameter timeout from config section ns/server/${server}/module/nschartdir
+ *      config parameter timeout from config section ns/server/${server}/module/nschartdir,
+ *      returns number of closed charts
  *
  *
  * Authors
@@ -44,175 +84,2900 @@
  *     Vlad Seryakov vlad@crystalballinc.com
  */
 
-#define USE_TCL8X
+#define USE_TCL8X
+
+extern "C" {
+#include "ns.h"
+}
+
+#include "chartdir.h"
+
+#define _VERSION           "0.9.6"
+
+/* Layer slots kept in the chart structure, more are allocated on demand */
+#define CHART_LAYERS       2
+
+/* Number of registry shards, must be a power of 2 */
+#define CHART_SHARDS       32
+
+/* Approximate chart footprint in bytes used for max_memory */
+#define CHART_PIXEL_SIZE   4
+#define CHART_POINT_SIZE   16
+#define CHART_LAYER_SIZE   1024
+
+/* Charts used since last queued moved to the tail per shard when evicting */
+#define CHART_EVICT_SCAN   8
+
+enum ChartType { XYChartType, PieChartType };
+enum ChartScope { GlobalScope, RequestScope };
+enum LayerType { LineType, BarType, AreaType, TrendType, PieType };
+
+struct _ChartInterp;
+struct _ChartTemplate;
+
+/* 128-bit FNV-1a spec hash, the only cache key, offset basis and prime */
+typedef unsigned __int128 ChartHash;
+#define CHART_HASH_BASIS   (((ChartHash) 0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL)
+
+typedef struct {
+    LayerType type;
+    Layer *layer;
+    BarLayer *bar;
+    LineLayer *line;
+    TrendLayer *trend;
+    int downsample;
+    int target;
+    double *x;
+    int xcount;
+    int xsource;
+} ChartLayer;
+
+/*
+ * Chart structures are never freed, destroyed charts are kept in the pool
+ * for reuse, so a stale pointer cached in a chart handle always points to
+ * valid memory and is detected by the generation check. Generation is
+ * cleared when the chart is unregistered, so handles fail even while other
+ * threads keep the chart pinned. Reference count, generation and access
+ * time are updated with atomic operations.
+ */
+typedef struct _Chart {
+    struct _Chart *next, *prev;
+    long id;
+    int refcount;
+    unsigned long generation;
+    Ns_Mutex lock;
+    time_t access_time;
+    time_t queue_time;
+    ChartType type;
+    ChartScope scope;
+    struct _ChartInterp *owner;
+    struct _ChartTemplate *recording;
+    ChartHash hash;
+    BaseChart *chart;
+    XYChart *xy;
+    PieChart *pie;
+    PlotArea *plotarea;
+    int width;
+    int height;
+    long size;
+    int budget;
+    long points;
+    int plotwidth;
+    int nlayers;
+    int maxlayers;
+    ChartLayer *layers;
+    ChartLayer inlayers[CHART_LAYERS];
+    int nassets;
+    struct _ChartAsset **assets;
+} Ns_Chart;
+
+/*
+ * Per interp data, holds request scoped charts which are never put into
+ * the global registry and are freed when the interp is deallocated
+ */
+typedef struct _ChartInterp {
+    Tcl_HashTable charts;
+    long nextId;
+    struct _ChartTemplate *recording;
+    Ns_Chart *recordChart;
+} ChartInterp;
+
+/*
+ * Chart template, create arguments and the list of chart commands which
+ * are applied to the new chart by calling command procs directly. Commands
+ * are kept as strings so templates can be shared between threads.
+ */
+typedef int (ChartProc) (Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp);
+
+typedef struct {
+    const char *name;
+    ChartProc *proc;
+    char *args;
+} ChartTemplateCmd;
+
+typedef struct _ChartTemplate {
+    int refcount;
+    char *create;
+    int count;
+    ChartTemplateCmd *cmds;
+} ChartTemplate;
+
+static Tcl_HashTable templateTable;
+static Ns_Mutex templateMutex;
+
+/*
+ * Scripts run periodically by the scheduler, usually to pre-render charts
+ * into files. The structure is freed by the scheduler delete proc once the
+ * event is cancelled and not running.
+ */
+typedef struct {
+    int id;
+    int interval;
+    char *script;
+} ChartSchedule;
+
+static Tcl_HashTable scheduleTable;
+static Ns_Mutex scheduleMutex;
+
+static ChartTemplate *getTemplate(const char *name);
+static void releaseTemplate(ChartTemplate * tmpl);
+static int applyTemplate(Ns_Chart * chart, ChartTemplate * tmpl, Tcl_Interp * interp);
+static void templateAppend(ChartTemplate * tmpl, const char *name, ChartProc * proc, Tcl_Obj * args);
+
+static int ChartCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONST objv[]);
+static int ChartInterpInit(Tcl_Interp * interp, const void *context);
+static int ChartInterpCleanup(Tcl_Interp * interp, const void *context);
+static void ChartInterpFree(ClientData arg, Tcl_Interp * interp);
+static void ChartGC(void *arg, int id);
+static void assetPreload(const char *list);
+static int chartColor(Tcl_Interp * interp, Tcl_Obj * obj, int *color);
+static void fontPreload(const char *list, const char *dirs);
+static void RenderThread(void *arg);
+
+/*
+ * Chart registry, charts are hashed by id into shards each protected by
+ * its own lock so lookups do not serialize on one global mutex. Every shard
+ * also keeps its charts in a list ordered by queue time, oldest first, so
+ * GC only looks at charts which may have expired. Access does not reorder
+ * the list, GC moves recently used charts to the tail instead.
+ */
+typedef struct {
+    Ns_Mutex lock;
+    Tcl_HashTable charts;
+    Ns_Chart *head, *tail;
+} ChartShard;
+
+static ChartShard chartShards[CHART_SHARDS];
+static Ns_Mutex chartMutex;
+static Ns_Mutex chartPoolMutex;
+static Ns_Chart *chartPool = 0;
+static unsigned long chartGeneration = 0;
+static int chartIdleTimeout = 600;
+static int chartGCInterval = 600;
+static int chartRequestScope = 0;
+static long chartID = 0;
+static unsigned long chartGCPasses = 0;
+static unsigned long chartGCFreed = 0;
+static Ns_Time chartGCLastPause;
+
+/*
+ * Registry budget, charts over max_charts or max_memory are evicted least
+ * recently used first. Live count and memory only include registered
+ * global charts, the only ones which can be evicted, memory of request,
+ * render and template charts is not counted.
+ */
+static Ns_Mutex chartEvictMutex;
+static int chartMaxCharts = 0;
+static long chartMaxMemory = 0;
+static long chartMemory = 0;
+static long chartLive = 0;
+static unsigned long chartEvicted = 0;
+
+/*
+ * Per phase timing, counters are updated with atomic operations, histogram
+ * bucket i counts calls which took less than 2^i microseconds, the last
+ * one all longer calls
+ */
+#define CHART_HIST 21
+
+enum ChartPhase { PhaseDispatch, PhaseParse, PhaseLayout, PhaseEncode, PhaseReturn, PhaseCount };
+
+static struct {
+    const char *name;
+    unsigned long count;
+    unsigned long usec;
+    unsigned long max;
+    unsigned long hist[CHART_HIST];
+} chartPhases[PhaseCount] = {
+    { "dispatch", 0, 0, 0, { 0 } },
+    { "parse", 0, 0, 0, { 0 } },
+    { "layout", 0, 0, 0, { 0 } },
+    { "encode", 0, 0, 0, { 0 } },
+    { "return", 0, 0, 0, { 0 } }
+};
+
+static int chartStats = 1;
+static unsigned long chartBytes = 0;
+static unsigned long chartImages = 0;
+static unsigned long chartShardBusy = 0;
+static unsigned long chartLockBusy = 0;
+
+/*
+ * Rendered image cache, images are keyed by hash of the commands used to
+ * build the chart so identical charts are encoded only once
+ */
+typedef struct _ChartImage {
+    struct _ChartImage *next, *prev;
+    Tcl_HashEntry *hPtr;
+    int refcount;
+    time_t expires;
+    int format;
+    int len;
+    char data[1];
+} ChartImage;
+
+static Tcl_HashTable cacheTable;
+static ChartImage *cacheHead = 0, *cacheTail = 0;
+static Ns_Mutex cacheMutex;
+static int cacheMaxSize = 0;
+static int cacheTTL = 60;
+static int cacheSize = 0;
+static unsigned long cacheHits = 0;
+static unsigned long cacheMisses = 0;
+
+/*
+ * Output formats with ChartDirector format id and MIME type
+ */
+static const struct {
+    const char *name;
+    int format;
+    const char *type;
+} chartFormats[] = {
+    { "png", PNG, "image/png" },
+    { "jpg", JPG, "image/jpeg" },
+    { "jpeg", JPG, "image/jpeg" },
+    { "gif", GIF, "image/gif" },
+    { "bmp", BMP, "image/bmp" },
+    { "wbmp", WMP, "image/vnd.wap.wbmp" },
+    { "svg", SVG, "image/svg+xml" },
+    { 0, 0, 0 }
+};
+
+typedef struct {
+    int format;
+    int quality;
+} ChartFormat;
+
+/*
+ * Image files used by charts, backgrounds, wallpapers, patterns and symbols,
+ * are kept in memory and passed to ChartDirector as resources. Charts hold
+ * references to the assets they use until destroyed.
+ */
+typedef struct _ChartAsset {
+    struct _ChartAsset *next, *prev;
+    Tcl_HashEntry *hPtr;
+    int refcount;
+    time_t mtime;
+    time_t checked;
+    char *name;
+    int len;
+    char data[1];
+} ChartAsset;
+
+static Tcl_HashTable assetTable;
+static ChartAsset *assetHead = 0, *assetTail = 0;
+static Ns_Mutex assetMutex;
+static int assetMaxSize = 0;
+static int assetCheck = 5;
+static int assetSize = 0;
+static unsigned long assetHits = 0;
+static unsigned long assetLoads = 0;
+
+/*
+ * Fonts resolved and loaded at startup, maps font name to the full path,
+ * the table is read only after module init
+ */
+static Tcl_HashTable fontTable;
+
+/*
+ * Render thread pool, jobs are executed by dedicated threads each with its
+ * own interp, used to render and send charts off the connection threads
+ */
+struct _ChartBatch;
+
+typedef struct _ChartJob {
+    struct _ChartJob *next;
+    void (*proc) (struct _ChartJob * job, Tcl_Interp * interp);
+    Ns_Chart *chart;
+    Ns_Time queued;
+    char *channel;
+    char *headers;
+    Ns_Sock *sock;
+    char *file;
+    ChartFormat fmt;
+    struct _ChartBatch *batch;
+    int index;
+} ChartJob;
+
+/*
+ * Charts rendered in parallel by renderbatch, the caller waits until all
+ * jobs are done
+ */
+typedef struct _ChartBatch {
+    Ns_Mutex lock;
+    Ns_Cond cond;
+    int pending;
+    const char *dir;
+    ChartImage **images;
+    int *errors;
+} ChartBatch;
+
+static struct {
+    Ns_Mutex lock;
+    Ns_Cond cond;
+    ChartJob *head, *tail;
+    int threads;
+    int maxqueue;
+    int queued;
+    unsigned long jobs;
+    Ns_Time waittime, maxwait;
+    Ns_Time rendertime, maxrender;
+} renderPool;
+
+/*
+ * Admission control, renders started by Tcl commands take one of slots,
+ * up to maxwaiters callers wait at most timeout msecs for a free slot,
+ * others fail at once. Render threads are bounded by the pool instead.
+ */
+static struct {
+    Ns_Mutex lock;
+    Ns_Cond cond;
+    int slots;
+    int busy;
+    int waiters;
+    int maxwaiters;
+    int timeout;
+    unsigned long rejected;
+    unsigned long timedout;
+} renderSlots;
+
+/* Size limits of a chart, 0 means unlimited */
+static int chartMaxPixels = 0;
+static int chartMaxPoints = 0;
+static int chartMaxTotalPoints = 0;
+
+static const char *chartServer;
+
+/* Tcl object types used to read numbers without string conversion */
+static const Tcl_ObjType *intObjType;
+static const Tcl_ObjType *wideIntObjType;
+static const Tcl_ObjType *doubleObjType;
+static const Tcl_ObjType *listObjType;
+static const Tcl_ObjType *byteArrayObjType;
+
+static const char *chartAligments[] = { "Bottom", "2",
+    "BottomLeft", "1",
+    "BottomCenter", "2",
+    "BottomRight", "3",
+    "Left", "4",
+    "Center", "5",
+    "Right", "6",
+    "Top", "8",
+    "TopLeft", "7",
+    "TopCenter", "8",
+    "TopRight", "9",
+    0
+};
+
+static const char *chartLineTypes[] = { "DashLine", "1285",     // 0x505
+    "DotLine", "514",           // 0x202
+    "DotDashLine", "84214277",  // 0x05050205
+    "AltDashLine", "168101125", // 0x0A050505
+    0
+};
+
+static const char *chartSymbolTypes[] = { "NoSymbol",
+    "SquareSymbol",
+    "DiamondSymbol",
+    "TriangleSymbol",
+    "RightTriangleSymbol",
+    "LeftTriangleSymbol",
+    "InvertedTriangleSymbol",
+    "CircleSymbol",
+    "CrossSymbol",
+    "Cross2Symbol",
+    0
+};
+
+static const char *chartDataCombineMethods[] = { "Overlay", "Stack", "Depth", "Side", 0 };
+
+static const char *chartLegendModes[] = { "NormalLegend", "ReverseLegend", "NoLegend", 0 };
+
+extern "C" {
+
+    NS_EXPORT int Ns_ModuleVersion = 1;
+
+/*
+ * Load the config parameters, setup the structures
+ */
+
+    NS_EXPORT int Ns_ModuleInit(const char *server, const char *module) {
+        const char *path;
+        int i;
+
+         Ns_Log(Notice, "nschartdir module version %s server: %s", _VERSION, server);
+
+         path = Ns_ConfigGetPath(server, module, NULL);
+         Ns_ConfigGetInt(path, "idle_timeout", &chartIdleTimeout);
+         Ns_ConfigGetInt(path, "gc_interval", &chartGCInterval);
+         Ns_ConfigGetBool(path, "request_scope", &chartRequestScope);
+         Ns_ConfigGetInt(path, "cache_size", &cacheMaxSize);
+         Ns_ConfigGetInt(path, "cache_ttl", &cacheTTL);
+         Ns_ConfigGetInt(path, "asset_cache_size", &assetMaxSize);
+         Ns_ConfigGetInt(path, "asset_check", &assetCheck);
+         Ns_ConfigGetBool(path, "stats", &chartStats);
+         Ns_ConfigGetInt(path, "max_charts", &chartMaxCharts);
+         if (Ns_ConfigGetInt(path, "max_memory", &i))
+             chartMaxMemory = (long) i * 1024 * 1024;
+         renderPool.maxqueue = 100;
+         Ns_ConfigGetInt(path, "render_threads", &renderPool.threads);
+         Ns_ConfigGetInt(path, "render_queue", &renderPool.maxqueue);
+         renderSlots.maxwaiters = 10;
+         renderSlots.timeout = 1000;
+         Ns_ConfigGetInt(path, "render_slots", &renderSlots.slots);
+         Ns_ConfigGetInt(path, "render_waiters", &renderSlots.maxwaiters);
+         Ns_ConfigGetInt(path, "render_timeout", &renderSlots.timeout);
+         Ns_ConfigGetInt(path, "max_pixels", &chartMaxPixels);
+         Ns_ConfigGetInt(path, "max_points", &chartMaxPoints);
+         Ns_ConfigGetInt(path, "max_total_points", &chartMaxTotalPoints);
+        chartServer = ns_strdup(server);
+        Ns_MutexSetName2(&cacheMutex, "nschartdir", "cache");
+        Tcl_InitHashTable(&cacheTable, TCL_STRING_KEYS);
+        Ns_MutexSetName2(&templateMutex, "nschartdir", "template");
+        Tcl_InitHashTable(&templateTable, TCL_STRING_KEYS);
+        Ns_MutexSetName2(&scheduleMutex, "nschartdir", "schedule");
+        Tcl_InitHashTable(&scheduleTable, TCL_STRING_KEYS);
+        Ns_MutexSetName2(&assetMutex, "nschartdir", "asset");
+        Tcl_InitHashTable(&assetTable, TCL_STRING_KEYS);
+        assetPreload(Ns_ConfigGetValue(path, "assets"));
+        Tcl_InitHashTable(&fontTable, TCL_STRING_KEYS);
+        fontPreload(Ns_ConfigGetValue(path, "fonts"), Ns_ConfigGetValue(path, "font_path"));
+        intObjType = Tcl_GetObjType("int");
+        wideIntObjType = Tcl_GetObjType("wideInt");
+        doubleObjType = Tcl_GetObjType("double");
+        listObjType = Tcl_GetObjType("list");
+        byteArrayObjType = Tcl_GetObjType("bytearray");
+        for (int i = 0; i < CHART_SHARDS; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "shard%d", i);
+            Ns_MutexSetName2(&chartShards[i].lock, "nschartdir", name);
+            Tcl_InitHashTable(&chartShards[i].charts, TCL_ONE_WORD_KEYS);
+        }
+        /* Schedule garbage collection proc for automatic chart close/cleanup */
+        if (chartGCInterval > 0) {
+            Ns_Time interval;
+            interval.sec = chartGCInterval;  interval.usec = 0;
+            Ns_ScheduleProcEx(ChartGC, 0, NS_SCHED_THREAD, &interval, NULL);
+            Ns_Log(Notice, "ns_chartdir: scheduling GC proc for every %d secs", chartGCInterval);
+        }
+        Ns_MutexSetName2(&chartMutex, "nschartdir", "chart");
+        Ns_MutexSetName2(&chartPoolMutex, "nschartdir", "pool");
+        Ns_MutexSetName2(&chartEvictMutex, "nschartdir", "evict");
+        Ns_MutexSetName2(&renderPool.lock, "nschartdir", "render");
+        Ns_MutexSetName2(&renderSlots.lock, "nschartdir", "slots");
+        for (int i = 0; i < renderPool.threads; i++)
+            Ns_ThreadCreate(RenderThread, (void *) (long) i, 0, NULL);
+        if (renderPool.threads > 0)
+            Ns_Log(Notice, "ns_chartdir: started %d render threads, queue %d", renderPool.threads, renderPool.maxqueue);
+        Ns_TclRegisterTrace(server, ChartInterpInit, 0, NS_TCL_TRACE_CREATE);
+        Ns_TclRegisterTrace(server, ChartInterpCleanup, 0, NS_TCL_TRACE_DEALLOCATE);
+        return NS_OK;
+    }
+
+}
+
+/*
+ * Add ns_chartdir commands to interp.
+ */
+static int ChartInterpInit(Tcl_Interp * interp, const void *context)
+{
+    ChartInterp *data = (ChartInterp *) ns_calloc(1, sizeof(ChartInterp));
+
+    Tcl_InitHashTable(&data->charts, TCL_ONE_WORD_KEYS);
+    Tcl_SetAssocData(interp, "nschartdir", ChartInterpFree, data);
+    Tcl_CreateObjCommand(interp, "ns_chartdir", ChartCmd, data, NULL);
+    return NS_OK;
+}
+
+static ChartShard *chartShard(long id)
+{
+    return &chartShards[(unsigned long) id & (CHART_SHARDS - 1)];
+}
+
+// Access list maintenance, shard must be locked
+static void chartUnlink(ChartShard * shard, Ns_Chart * chart)
+{
+    if (chart->prev)
+        chart->prev->next = chart->next;
+    else
+        shard->head = chart->next;
+    if (chart->next)
+        chart->next->prev = chart->prev;
+    else
+        shard->tail = chart->prev;
+    chart->next = chart->prev = 0;
+}
+
+static void chartAppend(ChartShard * shard, Ns_Chart * chart)
+{
+    chart->next = 0;
+    chart->prev = shard->tail;
+    if (shard->tail)
+        shard->tail->next = chart;
+    else
+        shard->head = chart;
+    shard->tail = chart;
+}
+
+// Atomic access to chart fields shared between threads without lock
+#define chartLoad(p)        __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define chartStore(p, v)    __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define chartCount(p, v)    __atomic_add_fetch(p, v, __ATOMIC_RELAXED)
+
+static void chartPhaseStart(Ns_Time * start)
+{
+    if (chartStats)
+        Ns_GetTime(start);
+}
+
+static void chartPhaseEnd(int phase, Ns_Time * start)
+{
+    Ns_Time end, diff;
+    unsigned long usec, max;
+    int i;
+
+    if (!chartStats)
+        return;
+    Ns_GetTime(&end);
+    Ns_DiffTime(&end, start, &diff);
+    usec = diff.sec * 1000000UL + diff.usec;
+    for (i = 0; i < CHART_HIST - 1 && usec >= (1UL << i); i++);
+    chartCount(&chartPhases[phase].count, 1UL);
+    chartCount(&chartPhases[phase].usec, usec);
+    chartCount(&chartPhases[phase].hist[i], 1UL);
+    max = chartLoad(&chartPhases[phase].max);
+    while (usec > max && !__atomic_compare_exchange_n(&chartPhases[phase].max, &max, usec, false,
+                                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+// Locks the mutex counting how often it was busy
+static void chartLock(Ns_Mutex * lock, unsigned long *busy)
+{
+    if (Ns_MutexTryLock(lock) != NS_OK) {
+        chartCount(busy, 1UL);
+        Ns_MutexLock(lock);
+    }
+}
+
+/*
+ * Takes extra reference unless the chart is already destroyed
+ */
+static int retainChart(Ns_Chart * chart)
+{
+    int refcount = chartLoad(&chart->refcount);
+
+    while (refcount > 0) {
+        if (__atomic_compare_exchange_n(&chart->refcount, &refcount, refcount + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns new chart structure from the pool with zero reference count
+ */
+static void releaseAsset(ChartAsset * asset);
+
+static void chartInitLayers(Ns_Chart * chart)
+{
+    chart->layers = chart->inlayers;
+    chart->nlayers = 0;
+    chart->maxlayers = CHART_LAYERS;
+}
+
+// Adds to approximate chart footprint, budget charts also to max_memory usage
+static void chartAccount(Ns_Chart * chart, long bytes)
+{
+    chart->size += bytes;
+    if (chart->budget)
+        chartCount(&chartMemory, bytes);
+}
+
+static void chartResize(Ns_Chart * chart, int width, int height)
+{
+    chartAccount(chart, ((long) width * height - (long) chart->width * chart->height) * CHART_PIXEL_SIZE);
+    chart->width = width;
+    chart->height = height;
+}
+
+// Checks chart size is positive and within max_pixels
+static int chartLimitSize(Tcl_Interp * interp, int width, int height)
+{
+    if (width <= 0 || height <= 0) {
+        Tcl_AppendResult(interp, "chart width and height must be positive", 0);
+        return TCL_ERROR;
+    }
+    if (chartMaxPixels > 0 && (long) width * height > chartMaxPixels) {
+        char buf[64];
+
+        snprintf(buf, sizeof(buf), "%dx%d", width, height);
+        Tcl_SetErrorCode(interp, "NSCHARTDIR", "LIMIT", NULL);
+        Tcl_AppendResult(interp, "chart size ", buf, " exceeds max_pixels", 0);
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+// Checks new series against max_points and max_total_points and counts it
+static int chartLimitPoints(Ns_Chart * chart, int count, Tcl_Interp * interp)
+{
+    if (chartMaxPoints > 0 && count > chartMaxPoints) {
+        Tcl_SetErrorCode(interp, "NSCHARTDIR", "LIMIT", NULL);
+        Tcl_AppendResult(interp, "number of points exceeds max_points, use -downsample", 0);
+        return TCL_ERROR;
+    }
+    if (chartMaxTotalPoints > 0 && chart->points + count > chartMaxTotalPoints) {
+        Tcl_SetErrorCode(interp, "NSCHARTDIR", "LIMIT", NULL);
+        Tcl_AppendResult(interp, "number of chart points exceeds max_total_points", 0);
+        return TCL_ERROR;
+    }
+    chart->points += count;
+    return TCL_OK;
+}
+
+/*
+ * Frees layer table and releases assets, called once ChartDirector chart
+ * is destroyed
+ */
+static void chartClear(Ns_Chart * chart)
+{
+    chartAccount(chart, -chart->size);
+    chart->budget = 0;
+    chart->width = chart->height = 0;
+    chart->points = 0;
+    for (int i = 0; i < chart->nlayers; i++)
+        ns_free(chart->layers[i].x);
+    if (chart->layers != chart->inlayers)
+        ns_free(chart->layers);
+    chartInitLayers(chart);
+    for (int i = 0; i < chart->nassets; i++)
+        releaseAsset(chart->assets[i]);
+    ns_free(chart->assets);
+    chart->assets = 0;
+    chart->nassets = 0;
+}
+
+/*
+ * Returns index of the next layer slot, the table is doubled when full,
+ * the slot is taken by incrementing nlayers once the layer is created
+ */
+static int chartNextLayer(Ns_Chart * chart)
+{
+    if (chart->nlayers == chart->maxlayers) {
+        ChartLayer *layers = (ChartLayer *) ns_malloc(chart->maxlayers * 2 * sizeof(ChartLayer));
+
+        memcpy(layers, chart->layers, chart->nlayers * sizeof(ChartLayer));
+        if (chart->layers != chart->inlayers)
+            ns_free(chart->layers);
+        chart->layers = layers;
+        chart->maxlayers *= 2;
+    }
+    memset(&chart->layers[chart->nlayers], 0, sizeof(ChartLayer));
+    return chart->nlayers;
+}
+
+static Ns_Chart *allocChart(void)
+{
+    Ns_Chart *chart;
+
+    Ns_MutexLock(&chartPoolMutex);
+    if ((chart = chartPool))
+        chartPool = chart->next;
+    Ns_MutexUnlock(&chartPoolMutex);
+    if (!chart) {
+        chart = (Ns_Chart *) ns_calloc(1, sizeof(Ns_Chart));
+        Ns_MutexInit(&chart->lock);
+    }
+    chart->next = chart->prev = 0;
+    chart->owner = 0;
+    chart->recording = 0;
+    chart->chart = 0;
+    chart->xy = 0;
+    chart->pie = 0;
+    chart->plotarea = 0;
+    chart->width = chart->height = 0;
+    chart->size = 0;
+    chart->budget = 0;
+    chart->points = 0;
+    chartInitLayers(chart);
+    return chart;
+}
+
+static void destroyChart(Ns_Chart * chart)
+{
+    chart->chart->destroy();
+    chart->chart = 0;
+    chartClear(chart);
+    Ns_MutexLock(&chartPoolMutex);
+    chartStore(&chart->generation, 0UL);
+    chart->next = chartPool;
+    chartPool = chart;
+    Ns_MutexUnlock(&chartPoolMutex);
+}
+
+static void releaseChart(Ns_Chart * chart)
+{
+    if (__atomic_sub_fetch(&chart->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        destroyChart(chart);
+}
+
+/*
+ * Pins chart referenced by the handle, fails if the chart has been
+ * destroyed or its structure reused for another chart since
+ */
+static int pinChart(Ns_Chart * chart, unsigned long generation)
+{
+    if (!retainChart(chart))
+        return 0;
+    if (chartLoad(&chart->generation) != generation) {
+        releaseChart(chart);
+        return 0;
+    }
+    chartStore(&chart->access_time, time(0));
+    return 1;
+}
+
+/*
+ * Returns chart pinned with extra reference, caller must call releaseChart.
+ * Request scoped charts have negative ids and live in the interp table.
+ */
+static Ns_Chart *getChart(ChartInterp * data, long id)
+{
+    Ns_Chart *chart = 0;
+    Tcl_HashEntry *hPtr;
+    ChartShard *shard = chartShard(id);
+
+    if (id < 0) {
+        if (!data || !(hPtr = Tcl_FindHashEntry(&data->charts, (char *) id)))
+            return 0;
+        chart = (Ns_Chart *) Tcl_GetHashValue(hPtr);
+        retainChart(chart);
+        return chart;
+    }
+
+    chartLock(&shard->lock, &chartShardBusy);
+    hPtr = Tcl_FindHashEntry(&shard->charts, (char *) id);
+    if (hPtr) {
+        /* Registry holds a reference, so the chart cannot be destroyed here */
+        chart = (Ns_Chart *) Tcl_GetHashValue(hPtr);
+        retainChart(chart);
+        chartStore(&chart->access_time, time(0));
+    }
+    Ns_MutexUnlock(&shard->lock);
+    return chart;
+}
+
+/*
+ * Unlinks chart from the registry and drops registry reference, returns
+ * remaining reference count. Shard must be locked.
+ */
+static int unregisterChart(ChartShard * shard, Ns_Chart * chart)
+{
+    Tcl_HashEntry *hPtr;
+
+    if (chart->scope == RequestScope) {
+        if (!chart->owner)
+            return chartLoad(&chart->refcount);
+        if ((hPtr = Tcl_FindHashEntry(&chart->owner->charts, (char *) chart->id)))
+            Tcl_DeleteHashEntry(hPtr);
+        chart->owner = 0;
+        chartStore(&chart->generation, 0UL);
+        return __atomic_sub_fetch(&chart->refcount, 1, __ATOMIC_ACQ_REL);
+    }
+    hPtr = Tcl_FindHashEntry(&shard->charts, (char *) chart->id);
+
+    if (!hPtr || Tcl_GetHashValue(hPtr) != chart)
+        return chartLoad(&chart->refcount);
+    Tcl_DeleteHashEntry(hPtr);
+    chartUnlink(shard, chart);
+    chartCount(&chartLive, -1L);
+    chartStore(&chart->generation, 0UL);
+    return __atomic_sub_fetch(&chart->refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * Unlinks chart from the registry, the chart is destroyed once the last
+ * user releases it
+ */
+static void freeChart(Ns_Chart * chart)
+{
+    int refcount;
+    ChartShard *shard;
+
+    if (!chart)
+        return;
+
+    shard = chartShard(chart->id);
+    if (chart->scope == RequestScope)
+        refcount = unregisterChart(shard, chart);
+    else {
+        Ns_MutexLock(&shard->lock);
+        refcount = unregisterChart(shard, chart);
+        Ns_MutexUnlock(&shard->lock);
+    }
+    if (refcount == 0)
+        destroyChart(chart);
+}
+
+/*
+ * Garbage collection routine, closes expired charts. Charts are taken off
+ * the head of each shard list under a short lock while their queue time is
+ * older than idle timeout, the ones used since are moved to the tail.
+ * ChartDirector objects are destroyed afterwards without holding any lock.
+ * Returns number of closed charts.
+ */
+static int chartCollect(void)
+{
+    Ns_Chart *chart, *expired = 0;
+    Ns_Time start, end, diff;
+    int count = 0;
+    time_t now = time(0);
+
+    Ns_GetTime(&start);
+    for (int i = 0; i < CHART_SHARDS; i++) {
+        ChartShard *shard = &chartShards[i];
+
+        Ns_MutexLock(&shard->lock);
+        while ((chart = shard->head) && now - chart->queue_time > chartIdleTimeout) {
+            if (now - chartLoad(&chart->access_time) <= chartIdleTimeout) {
+                chartUnlink(shard, chart);
+                chart->queue_time = now;
+                chartAppend(shard, chart);
+                continue;
+            }
+            if (unregisterChart(shard, chart) == 0) {
+                chart->next = expired;
+                expired = chart;
+            }
+            count++;
+        }
+        Ns_MutexUnlock(&shard->lock);
+    }
+    while ((chart = expired)) {
+        expired = chart->next;
+        destroyChart(chart);
+    }
+    Ns_GetTime(&end);
+    Ns_DiffTime(&end, &start, &diff);
+
+    Ns_MutexLock(&chartMutex);
+    chartGCPasses++;
+    chartGCFreed += count;
+    chartGCLastPause = diff;
+    Ns_MutexUnlock(&chartMutex);
+
+    if (count)
+        Ns_Log(Notice, "ns_chartdir: GC: %d inactive charts closed in %ld.%06ld secs", count, diff.sec, diff.usec);
+    return count;
+}
+
+// Scheduled GC pass
+static void ChartGC(void *arg, int id)
+{
+    chartCollect();
+}
+
+static int chartOverBudget(void)
+{
+    return (chartMaxCharts > 0 && chartLoad(&chartLive) > chartMaxCharts) ||
+        (chartMaxMemory > 0 && chartLoad(&chartMemory) > chartMaxMemory);
+}
+
+/*
+ * Evicts least recently used charts while the registry is over budget.
+ * Shard heads used since they were queued are moved to the tail, the head
+ * with the oldest access time among all shards is evicted. Charts in use
+ * are skipped. Only one thread evicts at a time, others return at once.
+ */
+static void chartEvict(void)
+{
+    Ns_Chart *chart, *victim, *evicted = 0;
+    ChartShard *shard, *oldest;
+    unsigned long generation = 0;
+    time_t now = time(0);
+    int count = 0;
+
+    if (Ns_MutexTryLock(&chartEvictMutex) != NS_OK)
+        return;
+    while (chartOverBudget()) {
+        victim = 0;
+        oldest = 0;
+        for (int i = 0; i < CHART_SHARDS; i++) {
+            shard = &chartShards[i];
+            Ns_MutexLock(&shard->lock);
+            for (int n = 0; (chart = shard->head) && chart != shard->tail && n < CHART_EVICT_SCAN; n++) {
+                if (chartLoad(&chart->access_time) <= chart->queue_time && chartLoad(&chart->refcount) == 1)
+                    break;
+                chartUnlink(shard, chart);
+                chart->queue_time = now;
+                chartAppend(shard, chart);
+            }
+            if (chart && chartLoad(&chart->refcount) == 1 &&
+                (!victim || chartLoad(&chart->access_time) < chartLoad(&victim->access_time))) {
+                victim = chart;
+                oldest = shard;
+                generation = chartLoad(&chart->generation);
+            }
+            Ns_MutexUnlock(&shard->lock);
+        }
+        if (!victim)
+            break;
+        /* Victim may have been used or destroyed since the shard was unlocked */
+        Ns_MutexLock(&oldest->lock);
+        if (oldest->head == victim && chartLoad(&victim->generation) == generation &&
+            chartLoad(&victim->refcount) == 1 && unregisterChart(oldest, victim) == 0) {
+            victim->next = evicted;
+            evicted = victim;
+            /* Footprint is released when destroyed, count it now to stop the loop */
+            chartCount(&chartMemory, -victim->size);
+            count++;
+        }
+        Ns_MutexUnlock(&oldest->lock);
+    }
+    Ns_MutexUnlock(&chartEvictMutex);
+
+    while ((chart = evicted)) {
+        evicted = chart->next;
+        chartCount(&chartMemory, chart->size);
+        destroyChart(chart);
+    }
+    if (count) {
+        chartCount(&chartEvicted, (unsigned long) count);
+        Ns_Log(Debug, "ns_chartdir: %d charts evicted", count);
+    }
+}
+
+/*
+ * Chart handle object type, internal representation caches chart pointer
+ * and its generation so repeated calls with the same handle need neither
+ * registry lookup nor lock. String representation is the chart id and is
+ * never invalidated.
+ */
+static Tcl_ObjType chartObjType = {
+    (char *) "ns:chart",
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+static void setChartObj(Tcl_Obj * obj, Ns_Chart * chart)
+{
+    Tcl_GetString(obj);
+    if (obj->typePtr && obj->typePtr->freeIntRepProc)
+        obj->typePtr->freeIntRepProc(obj);
+    obj->internalRep.ptrAndLongRep.ptr = chart;
+    obj->internalRep.ptrAndLongRep.value = chart->generation;
+    obj->typePtr = &chartObjType;
+}
+
+static Tcl_Obj *newChartObj(Ns_Chart * chart)
+{
+    Tcl_Obj *obj = Tcl_NewLongObj(chart->id);
+
+    setChartObj(obj, chart);
+    return obj;
+}
+
+/*
+ * Resolves chart handle, returns pinned chart or 0 with error in the interp
+ */
+static Ns_Chart *chartFromObj(ChartInterp * data, Tcl_Obj * obj, Tcl_Interp * interp)
+{
+    long id;
+    Ns_Chart *chart = 0;
+
+    if (obj->typePtr == &chartObjType) {
+        chart = (Ns_Chart *) obj->internalRep.ptrAndLongRep.ptr;
+        if (pinChart(chart, obj->internalRep.ptrAndLongRep.value)) {
+            if (chart->scope != RequestScope || chart->owner == data)
+                return chart;
+            releaseChart(chart);
+        }
+        chart = 0;
+    } else if (Tcl_GetLongFromObj(interp, obj, &id) != TCL_OK)
+        return 0;
+    else if ((chart = getChart(data, id)))
+        setChartObj(obj, chart);
+    if (!chart)
+        Tcl_AppendResult(interp, "Invalid or expired chart object", 0);
+    return chart;
+}
+
+/*
+ * Frees request scoped charts of the interp, called at the end of connection
+ */
+static void freeInterpCharts(ChartInterp * data)
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+
+    while ((hPtr = Tcl_FirstHashEntry(&data->charts, &search)))
+        freeChart((Ns_Chart *) Tcl_GetHashValue(hPtr));
+}
+
+static int ChartInterpCleanup(Tcl_Interp * interp, const void *context)
+{
+    ChartInterp *data = (ChartInterp *) Tcl_GetAssocData(interp, "nschartdir", NULL);
+
+    if (data)
+        freeInterpCharts(data);
+    return NS_OK;
+}
+
+static void ChartInterpFree(ClientData arg, Tcl_Interp * interp)
+{
+    ChartInterp *data = (ChartInterp *) arg;
+
+    freeInterpCharts(data);
+    Tcl_DeleteHashTable(&data->charts);
+    ns_free(data);
+}
+
+// FNV-1a hash of chart spec, prime is 2^88 + 0x13b
+static void chartHash(Ns_Chart * chart, const char *data, int len)
+{
+    ChartHash hash = chart->hash;
+
+    while (len-- > 0) {
+        hash ^= (unsigned char) *data++;
+        hash = hash * 0x13b + (hash << 88);
+    }
+    chart->hash = hash;
+}
+
+/*
+ * Hashes one element as type tag, length and data, so elements of
+ * different types or lengths never run into each other
+ */
+static void chartHashItem(Ns_Chart * chart, char tag, const char *data, int len)
+{
+    char head[5];
+
+    head[0] = tag;
+    memcpy(head + 1, &len, sizeof(len));
+    chartHash(chart, head, sizeof(head));
+    if (data)
+        chartHash(chart, data, len);
+}
+
+static int chartIsNumber(Tcl_Obj * obj)
+{
+    return obj->typePtr &&
+        (obj->typePtr == doubleObjType || obj->typePtr == intObjType || obj->typePtr == wideIntObjType);
+}
+
+/*
+ * Hashes object by its string or, if there is none, by its numeric, list
+ * or byte value so data built from numbers or packed binary does not get
+ * string representation
+ */
+static void chartHashObj(Ns_Chart * chart, Tcl_Obj * obj)
+{
+    int len;
+    char *str;
+
+    if (!obj->bytes && byteArrayObjType && obj->typePtr == byteArrayObjType) {
+        str = (char *) Tcl_GetByteArrayFromObj(obj, &len);
+        chartHashItem(chart, 'b', str, len);
+    } else if (!obj->bytes && chartIsNumber(obj)) {
+        double value;
+        Tcl_GetDoubleFromObj(0, obj, &value);
+        chartHashItem(chart, 'n', (char *) &value, sizeof(value));
+    } else if (!obj->bytes && obj->typePtr == listObjType) {
+        Tcl_Obj **objv;
+        Tcl_ListObjGetElements(0, obj, &len, &objv);
+        /* Number of elements instead of length */
+        chartHashItem(chart, 'l', 0, len);
+        for (int i = 0; i < len; i++)
+            chartHashObj(chart, objv[i]);
+    } else {
+        str = Tcl_GetStringFromObj(obj, &len);
+        chartHashItem(chart, 's', str, len);
+    }
+}
+
+// Spec hash is only the image cache key, nothing to do without the cache
+static void chartHashObjs(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[])
+{
+    if (cacheMaxSize <= 0)
+        return;
+    for (int i = 0; i < objc; i++)
+        chartHashObj(chart, objv[i]);
+}
+
+static const double chartPow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+ * Converts decimal number, plain numbers with up to 15 significant digits
+ * are converted exactly without strtod, anything else including invalid
+ * input is passed to atof as before
+ */
+static double chartParseDouble(const char *str)
+{
+    const char *p = str;
+    Tcl_WideUInt mantissa = 0;
+    int digits = 0, scale = 0, neg = 0, any = 0;
+
+    while (*p == ' ' || *p == '\t' || *p == '\n')
+        p++;
+    if (*p == '-' || *p == '+')
+        neg = (*p++ == '-');
+    for (; *p >= '0' && *p <= '9'; p++, any = 1)
+        if (mantissa || *p != '0') {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits++;
+        }
+    if (*p == '.')
+        for (p++; *p >= '0' && *p <= '9'; p++, any = 1) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa)
+                digits++;
+            scale++;
+        }
+    while (*p == ' ' || *p == '\t' || *p == '\n')
+        p++;
+    if (*p || !any || digits > 15 || scale > 22)
+        return atof(str);
+    return neg ? -(mantissa / chartPow10[scale]) : mantissa / chartPow10[scale];
+}
+
+/*
+ * Data options accepted by layer create and dataset before other arguments
+ */
+enum DownsampleType { NoDownsample, LTTBDownsample, MinMaxDownsample, AvgDownsample };
+
+typedef struct {
+    int binary;                 /* 0 list, 4 float32 or 8 float64 byte array */
+    int downsample;             /* DownsampleType */
+    int target;                 /* number of points after downsampling, 0 - plot area width */
+} ChartDataOptions;
+
+/*
+ * Parses data options starting at objv[4], returns new objc with options
+ * removed from the arguments copied into args or -1 on error
+ */
+static int chartDataOptions(Tcl_Interp * interp, int objc, Tcl_Obj * CONST objv[], Tcl_Obj ** args, ChartDataOptions * opts)
+{
+    int i;
+
+    memset(opts, 0, sizeof(ChartDataOptions));
+    for (i = 4; i + 1 < objc; i += 2) {
+        char *opt = Tcl_GetStringFromObj(objv[i], 0);
+
+        if (!strcmp(opt, "-binary")) {
+            static const char *formats[] = { "float64", "float32", 0 };
+            int format;
+            if (Tcl_GetIndexFromObj(interp, objv[i + 1], formats, "format", 0, &format) != TCL_OK)
+                return -1;
+            opts->binary = format ? 4 : 8;
+        } else if (!strcmp(opt, "-downsample")) {
+            static const char *methods[] = { "none", "lttb", "minmax", "avg", 0 };
+            if (Tcl_GetIndexFromObj(interp, objv[i + 1], methods, "method", 0, &opts->downsample) != TCL_OK)
+                return -1;
+        } else if (!strcmp(opt, "-target")) {
+            if (Tcl_GetIntFromObj(interp, objv[i + 1], &opts->target) != TCL_OK)
+                return -1;
+        } else
+            break;
+    }
+    memcpy(args, objv, 4 * sizeof(Tcl_Obj *));
+    memcpy(args + 4, objv + i, (objc - i) * sizeof(Tcl_Obj *));
+    return objc - (i - 4);
+}
+
+/*
+ * Converts data into array of doubles allocated with ns_malloc. Numbers
+ * with numeric internal representation are taken as is, strings are
+ * parsed directly without shimmering. With binary option data is a byte
+ * array of packed native doubles or floats.
+ */
+static double *chartDoubles(Tcl_Interp * interp, Tcl_Obj * obj, ChartDataOptions * opts, int *count)
+{
+    int argc;
+    Tcl_Obj **argv;
+    double *data;
+    Ns_Time start;
+
+    chartPhaseStart(&start);
+    if (opts && opts->binary) {
+        unsigned char *bytes = Tcl_GetByteArrayFromObj(obj, &argc);
+
+        if (argc % opts->binary) {
+            Tcl_AppendResult(interp, "binary data length is not a multiple of value size", 0);
+            return 0;
+        }
+        *count = argc / opts->binary;
+        data = (double *) ns_malloc((*count + 1) * sizeof(double));
+        if (opts->binary == 8)
+            memcpy(data, bytes, *count * sizeof(double));
+        else
+            for (int i = 0; i < *count; i++) {
+                float value;
+                memcpy(&value, bytes + i * sizeof(float), sizeof(float));
+                data[i] = value;
+            }
+        chartPhaseEnd(PhaseParse, &start);
+        return data;
+    }
+    if (Tcl_ListObjGetElements(interp, obj, &argc, &argv) != TCL_OK)
+        return 0;
+    data = (double *) ns_malloc((argc + 1) * sizeof(double));
+    for (int i = 0; i < argc; i++) {
+        if (chartIsNumber(argv[i]))
+            Tcl_GetDoubleFromObj(0, argv[i], &data[i]);
+        else
+            data[i] = chartParseDouble(Tcl_GetStringFromObj(argv[i], 0));
+    }
+    *count = argc;
+    chartPhaseEnd(PhaseParse, &start);
+    return data;
+}
+
+/*
+ * Downsampling kernels, all work in place in one pass over the data and
+ * return new number of points. Original index of every kept point is
+ * stored into x, it is passed to ChartDirector as layer x data because
+ * lttb and minmax keep unevenly spaced points. NoValue points are skipped.
+ */
+
+// Largest-Triangle-Three-Buckets, keeps points forming the largest triangles
+static int downsampleLTTB(double *data, double *x, int count, int target)
+{
+    double every = (double) (count - 2) / (target - 2);
+    double ax = 0, ay = data[0];
+    int j = 1;
+
+    x[0] = 0;
+    for (int i = 0; i < target - 2; i++) {
+        int start = (int) (i * every) + 1;
+        int end = (int) ((i + 1) * every) + 1;
+        int nstart = end;
+        int nend = (int) ((i + 2) * every) + 1;
+        double nx = 0, ny = 0, area, maxarea = -1, value = NoValue;
+        int n = 0, pick = start;
+
+        if (nend > count)
+            nend = count;
+        for (int k = nstart; k < nend; k++)
+            if (data[k] != NoValue) {
+                nx += k;
+                ny += data[k];
+                n++;
+            }
+        if (n) {
+            nx /= n;
+            ny /= n;
+        } else {
+            nx = nstart;
+            ny = ay;
+        }
+        for (int k = start; k < end; k++) {
+            if (data[k] == NoValue)
+                continue;
+            area = (ax - nx) * (data[k] - ay) - (ax - k) * (ny - ay);
+            if (area < 0)
+                area = -area;
+            if (area > maxarea) {
+                maxarea = area;
+                pick = k;
+                value = data[k];
+            }
+        }
+        x[j] = pick;
+        data[j++] = value;
+        if (value != NoValue) {
+            ax = pick;
+            ay = value;
+        }
+    }
+    x[j] = count - 1;
+    data[j++] = data[count - 1];
+    return j;
+}
+
+// Keeps minimum and maximum of every bucket in their original order
+static int downsampleMinMax(double *data, double *x, int count, int target)
+{
+    int buckets = target / 2;
+    double every = (double) count / buckets;
+    int j = 0;
+
+    for (int i = 0; i < buckets; i++) {
+        int start = (int) (i * every);
+        int end = i == buckets - 1 ? count : (int) ((i + 1) * every);
+        int imin = -1, imax = -1;
+
+        for (int k = start; k < end; k++) {
+            if (data[k] == NoValue)
+                continue;
+            if (imin < 0 || data[k] < data[imin])
+                imin = k;
+            if (imax < 0 || data[k] > data[imax])
+                imax = k;
+        }
+        if (imin < 0) {
+            x[j] = start;
+            data[j++] = NoValue;
+            x[j] = end - 1;
+            data[j++] = NoValue;
+            continue;
+        }
+        int first = imin < imax ? imin : imax, second = imin < imax ? imax : imin;
+        double v1 = data[first], v2 = data[second];
+        /* Flat bucket gives the same point twice, spread them over the bucket */
+        if (first == second) {
+            first = start;
+            second = end - 1;
+        }
+        x[j] = first;
+        data[j++] = v1;
+        x[j] = second;
+        data[j++] = v2;
+    }
+    return j;
+}
+
+// Replaces every bucket with its average placed in the bucket middle
+static int downsampleAvg(double *data, double *x, int count, int target)
+{
+    double every = (double) count / target;
+    int j = 0;
+
+    for (int i = 0; i < target; i++) {
+        int start = (int) (i * every);
+        int end = i == target - 1 ? count : (int) ((i + 1) * every);
+        double sum = 0;
+        int n = 0;
+
+        for (int k = start; k < end; k++)
+            if (data[k] != NoValue) {
+                sum += data[k];
+                n++;
+            }
+        x[j] = (start + end - 1) / 2.0;
+        data[j++] = n ? sum / n : NoValue;
+    }
+    return j;
+}
+
+// Takes points at x positions selected for the first series of the layer
+static int downsampleAt(double *data, const double *x, int count)
+{
+    for (int j = 0; j < count; j++)
+        data[j] = data[(int) x[j]];
+    return count;
+}
+
+/*
+ * Reduces data to the target number of points, x positions of the kept
+ * points are returned in x to be freed by the caller, 0 if not reduced
+ */
+static int chartDownsample(Ns_Chart * chart, ChartDataOptions * opts, double *data, int count, double **x)
+{
+    int target = opts->target;
+
+    *x = 0;
+    if (opts->downsample == NoDownsample)
+        return count;
+    if (target <= 0)
+        target = chart->plotwidth > 0 ? chart->plotwidth : chart->width;
+    if (target < 4 || count <= target)
+        return count;
+
+    *x = (double *) ns_malloc(target * sizeof(double));
+    switch (opts->downsample) {
+    case LTTBDownsample:
+        return downsampleLTTB(data, *x, count, target);
+    case MinMaxDownsample:
+        return downsampleMinMax(data, *x, count, target);
+    case AvgDownsample:
+        return downsampleAvg(data, *x, count, target);
+    }
+    ns_free(*x);
+    *x = 0;
+    return count;
+}
+
+/*
+ * Reduces dataset added to a layer the same way as the layer series. Layer
+ * has one x data, so the dataset is always taken at the layer positions
+ * and options which would move it elsewhere are rejected. Returns new
+ * number of points or -1 with NSCHARTDIR DOWNSAMPLE error code.
+ */
+static int chartLayerDownsample(Ns_Chart * chart, ChartLayer * slot, ChartDataOptions * opts, double *data, int count,
+                                Tcl_Interp * interp)
+{
+    const char *error = 0;
+    double *x;
+
+    if (opts->downsample && (opts->downsample != slot->downsample || opts->target != slot->target))
+        error = "dataset -downsample and -target must match the layer";
+    else if (slot->x && count != slot->xsource)
+        error = "dataset must have as many points as the downsampled layer series";
+    else if (slot->x && slot->downsample == AvgDownsample) {
+        x = (double *) ns_malloc(slot->xcount * sizeof(double));
+        count = downsampleAvg(data, x, count, slot->xcount);
+        ns_free(x);
+    } else if (slot->x)
+        count = downsampleAt(data, slot->x, slot->xcount);
+    else if (opts->downsample) {
+        /* Layer series was short enough to be kept as is */
+        chartDownsample(chart, opts, data, count, &x);
+        if (x) {
+            ns_free(x);
+            error = "dataset would be downsampled but the layer series was not";
+        }
+    }
+    if (error) {
+        Tcl_SetErrorCode(interp, "NSCHARTDIR", "DOWNSAMPLE", NULL);
+        Tcl_AppendResult(interp, error, 0);
+        return -1;
+    }
+    return count;
+}
+
+static void cacheKey(Ns_Chart * chart, ChartFormat * fmt, char *buf)
+{
+    sprintf(buf, "%016" TCL_LL_MODIFIER "x%016" TCL_LL_MODIFIER "x.%d.%d",
+            (Tcl_WideUInt) (chart->hash >> 64), (Tcl_WideUInt) chart->hash, chartFormats[fmt->format].format, fmt->quality);
+}
+
+static void cacheUnlink(ChartImage * image)
+{
+    if (image->prev)
+        image->prev->next = image->next;
+    else
+        cacheHead = image->next;
+    if (image->next)
+        image->next->prev = image->prev;
+    else
+        cacheTail = image->prev;
+    image->next = image->prev = 0;
+}
+
+static void cacheAppend(ChartImage * image)
+{
+    image->next = 0;
+    image->prev = cacheTail;
+    if (cacheTail)
+        cacheTail->next = image;
+    else
+        cacheHead = image;
+    cacheTail = image;
+}
+
+static void releaseImage(ChartImage * image)
+{
+    if (__atomic_sub_fetch(&image->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+        ns_free(image);
+}
+
+// Removes image from the cache, cacheMutex must be locked, returns image to free or 0
+static ChartImage *cacheRemove(ChartImage * image)
+{
+    Tcl_DeleteHashEntry(image->hPtr);
+    cacheUnlink(image);
+    cacheSize -= image->len;
+    return __atomic_sub_fetch(&image->refcount, 1, __ATOMIC_ACQ_REL) == 0 ? image : 0;
+}
+
+/*
+ * Returns cached image for the chart pinned with extra reference, caller
+ * must call releaseImage
+ */
+static ChartImage *cacheGet(Ns_Chart * chart, ChartFormat * fmt)
+{
+    char key[64];
+    Tcl_HashEntry *hPtr;
+    ChartImage *image = 0, *expired = 0;
+
+    if (cacheMaxSize <= 0)
+        return 0;
+    cacheKey(chart, fmt, key);
+    Ns_MutexLock(&cacheMutex);
+    if ((hPtr = Tcl_FindHashEntry(&cacheTable, key))) {
+        image = (ChartImage *) Tcl_GetHashValue(hPtr);
+        if (image->expires < time(0)) {
+            expired = cacheRemove(image);
+            image = 0;
+        } else {
+            __atomic_add_fetch(&image->refcount, 1, __ATOMIC_ACQ_REL);
+            cacheUnlink(image);
+            cacheAppend(image);
+        }
+    }
+    if (image)
+        cacheHits++;
+    else
+        cacheMisses++;
+    Ns_MutexUnlock(&cacheMutex);
+    ns_free(expired);
+    return image;
+}
+
+/*
+ * Allocates image blob with the only copy of the encoded image
+ */
+static ChartImage *newImage(MemBlock * mem, ChartFormat * fmt)
+{
+    ChartImage *image = (ChartImage *) ns_malloc(sizeof(ChartImage) + mem->len);
+
+    image->next = image->prev = 0;
+    image->hPtr = 0;
+    image->refcount = 1;
+    image->format = fmt->format;
+    image->len = mem->len;
+    memcpy(image->data, mem->data, mem->len);
+    return image;
+}
+
+/*
+ * Stores image in the cache which keeps its own reference
+ */
+static void cachePut(Ns_Chart * chart, ChartFormat * fmt, ChartImage * image)
+{
+    int isNew;
+    char key[64];
+    Tcl_HashEntry *hPtr;
+    ChartImage *old, *free = 0;
+
+    __atomic_add_fetch(&image->refcount, 1, __ATOMIC_ACQ_REL);
+    image->expires = time(0) + cacheTTL;
+
+    cacheKey(chart, fmt, key);
+    Ns_MutexLock(&cacheMutex);
+    if ((hPtr = Tcl_FindHashEntry(&cacheTable, key)) && (old = cacheRemove((ChartImage *) Tcl_GetHashValue(hPtr)))) {
+        old->next = free;
+        free = old;
+    }
+    /* Evict least recently used images until the new one fits */
+    while (cacheHead && cacheSize + image->len > cacheMaxSize) {
+        if ((old = cacheRemove(cacheHead))) {
+            old->next = free;
+            free = old;
+        }
+    }
+    image->hPtr = Tcl_CreateHashEntry(&cacheTable, key, &isNew);
+    Tcl_SetHashValue(image->hPtr, image);
+    cacheAppend(image);
+    cacheSize += image->len;
+    Ns_MutexUnlock(&cacheMutex);
+
+    while ((old = free)) {
+        free = old->next;
+        ns_free(old);
+    }
+}
+
+/*
+ * Parses -format and -quality options at objv[*i], returns 1 if parsed,
+ * 0 if it is not a format option or -1 on error
+ */
+static int chartFormatOption(Tcl_Interp * interp, int objc, Tcl_Obj * CONST objv[], int *i, ChartFormat * fmt)
+{
+    char *opt = Tcl_GetStringFromObj(objv[*i], 0);
+
+    if (strcmp(opt, "-format") && strcmp(opt, "-quality"))
+        return 0;
+    if (*i + 1 >= objc) {
+        Tcl_AppendResult(interp, "missing value for ", opt, 0);
+        return -1;
+    }
+    if (!strcmp(opt, "-format")) {
+        if (Tcl_GetIndexFromObjStruct(interp, objv[++*i], chartFormats, sizeof(chartFormats[0]), "format", 0,
+                                      &fmt->format) != TCL_OK)
+            return -1;
+    } else if (Tcl_GetIntFromObj(interp, objv[++*i], &fmt->quality) != TCL_OK)
+        return -1;
+    return 1;
+}
+
+/*
+ * Encodes the drawing, quality is passed to JPEG encoder, other formats use
+ * ChartDirector defaults
+ */
+static MemBlock areaEncode(DrawArea * area, ChartFormat * fmt)
+{
+    MemBlock mem;
+    Ns_Time start;
+
+    chartPhaseStart(&start);
+    switch (chartFormats[fmt->format].format) {
+    case JPG:
+        mem = area->outJPG2(fmt->quality > 0 ? fmt->quality : 80);
+        break;
+    case GIF:
+        mem = area->outGIF2();
+        break;
+    case BMP:
+        mem = area->outBMP2();
+        break;
+    case WMP:
+        mem = area->outWMP2();
+        break;
+    default:
+        mem = area->outPNG2();
+    }
+    chartPhaseEnd(PhaseEncode, &start);
+    chartCount(&chartBytes, (unsigned long) mem.len);
+    chartCount(&chartImages, 1UL);
+    return mem;
+}
+
+/*
+ * Lays out and draws the chart, then encodes it, SVG is produced by the
+ * chart directly
+ */
+static MemBlock chartEncode(BaseChart * chart, ChartFormat * fmt)
+{
+    DrawArea *area;
+    MemBlock mem;
+    Ns_Time start;
+
+    chartPhaseStart(&start);
+    if (chartFormats[fmt->format].format == SVG) {
+        mem = chart->makeChart(SVG);
+        chartPhaseEnd(PhaseLayout, &start);
+        chartCount(&chartBytes, (unsigned long) mem.len);
+        chartCount(&chartImages, 1UL);
+        return mem;
+    }
+    area = chart->makeChart();
+    chartPhaseEnd(PhaseLayout, &start);
+    return areaEncode(area, fmt);
+}
+
+/*
+ * Returns format by the file extension, png if unknown
+ */
+static void chartFileFormat(const char *file, ChartFormat * fmt)
+{
+    const char *ext = strrchr(file, '.');
+
+    fmt->format = 0;
+    for (int i = 0; ext && chartFormats[i].name; i++) {
+        if (!strcasecmp(ext + 1, chartFormats[i].name)) {
+            fmt->format = i;
+            break;
+        }
+    }
+}
+
+/*
+ * Writes data into a temp file in the same directory and renames it to
+ * the target, so readers never see partially written file. Returns 0 or
+ * -1 with errno set.
+ */
+static int chartWriteFile(const char *file, const char *data, int len)
+{
+    int fd, rc = -1, err;
+    Ns_DString ds;
+
+    Ns_DStringInit(&ds);
+    Ns_DStringVarAppend(&ds, file, ".XXXXXX", NULL);
+    if ((fd = ns_mkstemp(ds.string)) < 0) {
+        Ns_DStringFree(&ds);
+        return -1;
+    }
+    /* Short writes are continued, write returning 0 is reported as EIO */
+    for (ssize_t n; len > 0; data += n, len -= n) {
+        if ((n = write(fd, data, len)) > 0)
+            continue;
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n == 0)
+            errno = EIO;
+        break;
+    }
+    if (len == 0 && fchmod(fd, 0644) == 0 && close(fd) == 0) {
+        fd = -1;
+        rc = rename(ds.string, file);
+    }
+    if (rc != 0) {
+        err = errno;
+        if (fd >= 0)
+            close(fd);
+        unlink(ds.string);
+        errno = err;
+    }
+    Ns_DStringFree(&ds);
+    return rc;
+}
+
+/*
+ * Encodes the chart and puts the image into the cache if enabled, returns
+ * cached image or 0 if mem points to ChartDirector buffer
+ */
+static ChartImage *imageEncode(Ns_Chart * chart, ChartFormat * fmt, MemBlock * mem)
+{
+    ChartImage *image;
+
+    *mem = chartEncode(chart->chart, fmt);
+    if (cacheMaxSize <= 0 || mem->len > cacheMaxSize)
+        return 0;
+    image = newImage(mem, fmt);
+    cachePut(chart, fmt, image);
+    mem->data = image->data;
+    return image;
+}
+
+/*
+ * Returns image for the chart either from the cache or by rendering it,
+ * returned image if not 0 must be released with releaseImage
+ */
+static ChartImage *chartImage(Ns_Chart * chart, ChartFormat * fmt, MemBlock * mem)
+{
+    ChartImage *image = cacheGet(chart, fmt);
+
+    if (image) {
+        mem->data = image->data;
+        mem->len = image->len;
+        return image;
+    }
+    return imageEncode(chart, fmt, mem);
+}
+
+/*
+ * Takes a render slot, waits for a free one at most render_timeout msecs,
+ * fails with NSCHARTDIR BUSY error code if there is none
+ */
+static int renderAdmit(Tcl_Interp * interp)
+{
+    Ns_Time deadline;
+    int status = NS_OK;
+
+    if (renderSlots.slots <= 0)
+        return TCL_OK;
+    Ns_MutexLock(&renderSlots.lock);
+    if (renderSlots.busy >= renderSlots.slots) {
+        if (renderSlots.waiters >= renderSlots.maxwaiters) {
+            renderSlots.rejected++;
+            status = NS_ERROR;
+        } else {
+            Ns_GetTime(&deadline);
+            Ns_IncrTime(&deadline, renderSlots.timeout / 1000, (renderSlots.timeout % 1000) * 1000);
+            renderSlots.waiters++;
+            while (status == NS_OK && renderSlots.busy >= renderSlots.slots)
+                status = Ns_CondTimedWait(&renderSlots.cond, &renderSlots.lock, &deadline);
+            renderSlots.waiters--;
+            if (status != NS_OK)
+                renderSlots.timedout++;
+        }
+    }
+    if (status == NS_OK)
+        renderSlots.busy++;
+    Ns_MutexUnlock(&renderSlots.lock);
+    if (status != NS_OK) {
+        Tcl_SetErrorCode(interp, "NSCHARTDIR", "BUSY", NULL);
+        Tcl_AppendResult(interp, "too many charts are being rendered, try again later", 0);
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+static void renderRelease(void)
+{
+    if (renderSlots.slots <= 0)
+        return;
+    Ns_MutexLock(&renderSlots.lock);
+    renderSlots.busy--;
+    Ns_CondSignal(&renderSlots.cond);
+    Ns_MutexUnlock(&renderSlots.lock);
+}
+
+/*
+ * Same as chartImage but renders in a render slot, cached images are
+ * returned without one
+ */
+static int chartRender(Ns_Chart * chart, ChartFormat * fmt, MemBlock * mem, ChartImage ** image, Tcl_Interp * interp)
+{
+    if ((*image = cacheGet(chart, fmt))) {
+        mem->data = (*image)->data;
+        mem->len = (*image)->len;
+        return TCL_OK;
+    }
+    if (renderAdmit(interp) != TCL_OK)
+        return TCL_ERROR;
+    *image = imageEncode(chart, fmt, mem);
+    renderRelease();
+    return TCL_OK;
+}
+
+/*
+ * Image blob objects, Tcl object holds a reference to the image so it is
+ * passed to blob commands without copying. String representation is only
+ * generated if the object is used as a byte array by other commands.
+ */
+static void ImageFreeIntRep(Tcl_Obj * obj)
+{
+    releaseImage((ChartImage *) obj->internalRep.otherValuePtr);
+}
+
+static void ImageDupIntRep(Tcl_Obj * src, Tcl_Obj * dup)
+{
+    ChartImage *image = (ChartImage *) src->internalRep.otherValuePtr;
+
+    __atomic_add_fetch(&image->refcount, 1, __ATOMIC_ACQ_REL);
+    dup->internalRep.otherValuePtr = image;
+    dup->typePtr = src->typePtr;
+}
+
+// Same string as of byte array object, bytes are encoded as chars 0..255
+static void ImageUpdateString(Tcl_Obj * obj)
+{
+    ChartImage *image = (ChartImage *) obj->internalRep.otherValuePtr;
+    unsigned char *src = (unsigned char *) image->data;
+    char *dst;
+    int i, len = image->len;
+
+    for (i = 0; i < image->len; i++)
+        if (src[i] == 0 || src[i] > 0x7F)
+            len++;
+    obj->bytes = dst = (char *) ckalloc(len + 1);
+    obj->length = len;
+    for (i = 0; i < image->len; i++) {
+        if (src[i] == 0 || src[i] > 0x7F) {
+            *dst++ = (char) (0xC0 | (src[i] >> 6));
+            *dst++ = (char) (0x80 | (src[i] & 0x3F));
+        } else
+            *dst++ = src[i];
+    }
+    *dst = 0;
+}
+
+static int ImageSetFromAny(Tcl_Interp * interp, Tcl_Obj * obj)
+{
+    if (interp)
+        Tcl_AppendResult(interp, "not an image blob", 0);
+    return TCL_ERROR;
+}
+
+static Tcl_ObjType imageObjType = {
+    (char *) "ns:chartimage",
+    ImageFreeIntRep,
+    ImageDupIntRep,
+    ImageUpdateString,
+    ImageSetFromAny
+};
+
+// Returns blob object taking over image reference
+static Tcl_Obj *newImageObj(ChartImage * image)
+{
+    Tcl_Obj *obj = Tcl_NewObj();
+
+    Tcl_InvalidateStringRep(obj);
+    obj->internalRep.otherValuePtr = image;
+    obj->typePtr = &imageObjType;
+    return obj;
+}
+
+/*
+ * Returns image result either as blob object or byte array
+ */
+static Tcl_Obj *chartImageObj(ChartImage * image, MemBlock * mem, ChartFormat * fmt, int blob)
+{
+    if (!blob)
+        return Tcl_NewByteArrayObj((unsigned char *) mem->data, mem->len);
+    if (!image)
+        return newImageObj(newImage(mem, fmt));
+    __atomic_add_fetch(&image->refcount, 1, __ATOMIC_ACQ_REL);
+    return newImageObj(image);
+}
+
+/*
+ * Asset cache, assets are kept in least recently used order, file mtime
+ * is checked at most every asset_check seconds
+ */
+static void assetUnlink(ChartAsset * asset)
+{
+    if (asset->prev)
+        asset->prev->next = asset->next;
+    else
+        assetHead = asset->next;
+    if (asset->next)
+        asset->next->prev = asset->prev;
+    else
+        assetTail = asset->prev;
+    asset->next = asset->prev = 0;
+}
+
+static void assetAppend(ChartAsset * asset)
+{
+    asset->next = 0;
+    asset->prev = assetTail;
+    if (assetTail)
+        assetTail->next = asset;
+    else
+        assetHead = asset;
+    assetTail = asset;
+}
+
+static void releaseAsset(ChartAsset * asset)
+{
+    int refcount;
+
+    Ns_MutexLock(&assetMutex);
+    refcount = --asset->refcount;
+    Ns_MutexUnlock(&assetMutex);
+    if (refcount == 0)
+        ns_free(asset);
+}
+
+// Removes asset from the cache, assetMutex must be locked, returns asset to free or 0
+static ChartAsset *assetRemove(ChartAsset * asset)
+{
+    Tcl_DeleteHashEntry(asset->hPtr);
+    assetUnlink(asset);
+    assetSize -= asset->len;
+    return --asset->refcount == 0 ? asset : 0;
+}
+
+static ChartAsset *assetLoad(const char *path, struct stat *st)
+{
+    int fd, len = (int) st->st_size;
+    ssize_t n = 0;
+    ChartAsset *asset;
+
+    if (len > assetMaxSize || (fd = open(path, O_RDONLY)) < 0)
+        return 0;
+    asset = (ChartAsset *) ns_malloc(sizeof(ChartAsset) + len + strlen(path) + 3);
+    /* read may return less than asked, file truncated meanwhile is an error */
+    for (int off = 0; off < len; off += n) {
+        if ((n = read(fd, asset->data + off, len - off)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            close(fd);
+            ns_free(asset);
+            return 0;
+        }
+    }
+    close(fd);
+    asset->name = asset->data + len;
+    sprintf(asset->name, "@/%s", path);
+    asset->len = len;
+    asset->mtime = st->st_mtime;
+    asset->refcount = 1;
+    return asset;
+}
+
+/*
+ * Returns asset for the file pinned with extra reference or 0 if the
+ * cache is disabled or the file cannot be read
+ */
+static ChartAsset *assetGet(const char *path)
+{
+    int isNew;
+    struct stat st;
+    time_t now = time(0);
+    Tcl_HashEntry *hPtr;
+    ChartAsset *asset, *old = 0, *expired = 0;
+
+    if (assetMaxSize <= 0)
+        return 0;
+    Ns_MutexLock(&assetMutex);
+    if ((hPtr = Tcl_FindHashEntry(&assetTable, path))) {
+        asset = (ChartAsset *) Tcl_GetHashValue(hPtr);
+        if (now - asset->checked < assetCheck) {
+            asset->refcount++;
+            assetUnlink(asset);
+            assetAppend(asset);
+            assetHits++;
+            Ns_MutexUnlock(&assetMutex);
+            return asset;
+        }
+    }
+    Ns_MutexUnlock(&assetMutex);
+
+    if (stat(path, &st) != 0)
+        return 0;
+
+    Ns_MutexLock(&assetMutex);
+    if ((hPtr = Tcl_FindHashEntry(&assetTable, path))) {
+        asset = (ChartAsset *) Tcl_GetHashValue(hPtr);
+        if (asset->mtime == st.st_mtime && asset->len == st.st_size) {
+            asset->checked = now;
+            asset->refcount++;
+            assetUnlink(asset);
+            assetAppend(asset);
+            assetHits++;
+            Ns_MutexUnlock(&assetMutex);
+            return asset;
+        }
+    }
+    Ns_MutexUnlock(&assetMutex);
+
+    /* File is read without holding the lock */
+    if (!(asset = assetLoad(path, &st)))
+        return 0;
+    asset->checked = now;
+
+    Ns_MutexLock(&assetMutex);
+    hPtr = Tcl_CreateHashEntry(&assetTable, path, &isNew);
+    if (!isNew)
+        old = assetRemove((ChartAsset *) Tcl_GetHashValue(hPtr));
+    hPtr = Tcl_CreateHashEntry(&assetTable, path, &isNew);
+    Tcl_SetHashValue(hPtr, asset);
+    asset->hPtr = hPtr;
+    asset->refcount++;
+    assetAppend(asset);
+    assetSize += asset->len;
+    assetLoads++;
+    while (assetSize > assetMaxSize && assetHead != asset) {
+        ChartAsset *entry = assetRemove(assetHead);
+        if (entry) {
+            entry->next = expired;
+            expired = entry;
+        }
+    }
+    Ns_MutexUnlock(&assetMutex);
+    ns_free(old);
+    while (expired) {
+        old = expired->next;
+        ns_free(expired);
+        expired = old;
+    }
+    return asset;
+}
+
+/*
+ * Loads assets listed in the config at startup
+ */
+static void assetPreload(const char *list)
+{
+    int argc, count = 0;
+    const char **argv;
+    Ns_Time start, end, diff;
+    ChartAsset *asset;
+
+    if (!list || assetMaxSize <= 0 || Tcl_SplitList(0, list, &argc, &argv) != TCL_OK)
+        return;
+    Ns_GetTime(&start);
+    for (int i = 0; i < argc; i++) {
+        if (!(asset = assetGet(argv[i]))) {
+            Ns_Log(Warning, "ns_chartdir: cannot load asset %s", argv[i]);
+            continue;
+        }
+        releaseAsset(asset);
+        count++;
+    }
+    Tcl_Free((char *) argv);
+    Ns_GetTime(&end);
+    Ns_DiffTime(&end, &start, &diff);
+    Ns_Log(Notice, "ns_chartdir: loaded %d assets, %d bytes in %ld.%06ld secs", count, assetSize, diff.sec, diff.usec);
+}
+
+/*
+ * Returns image name to be passed to ChartDirector, cached file is set as
+ * chart resource, otherwise the file path is returned as is. File mtime and
+ * size go into the spec hash so a changed file is not served from the
+ * image cache.
+ */
+static const char *chartAsset(Ns_Chart * chart, const char *path)
+{
+    ChartAsset *asset;
+    struct stat st;
+    long key[2] = { 0, 0 };
+
+    asset = assetGet(path);
+    if (cacheMaxSize > 0) {
+        if (asset) {
+            key[0] = asset->mtime;
+            key[1] = asset->len;
+        } else if (stat(path, &st) == 0) {
+            key[0] = st.st_mtime;
+            key[1] = st.st_size;
+        }
+        chartHashItem(chart, 'f', (char *) key, sizeof(key));
+    }
+    if (!asset)
+        return path;
+    chart->assets = (ChartAsset **) ns_realloc(chart->assets, (chart->nassets + 1) * sizeof(ChartAsset *));
+    chart->assets[chart->nassets++] = asset;
+    chart->chart->setResource(asset->name + 2, MemBlock(asset->data, asset->len));
+    return asset->name;
+}
+
+/*
+ * Resolves font file against the font path and checks that it is a
+ * TrueType or OpenType font, returns full path to be freed or 0
+ */
+static char *fontResolve(const char *name, int dirc, const char **dirv)
+{
+    int fd;
+    char *file, magic[4];
+    Ns_DString ds;
+
+    Ns_DStringInit(&ds);
+    for (int i = -1; i < dirc; i++) {
+        Ns_DStringSetLength(&ds, 0);
+        if (i == -1)
+            Ns_DStringAppend(&ds, name);
+        else if (name[0] != '/')
+            Ns_DStringVarAppend(&ds, dirv[i], "/", name, NULL);
+        else
+            break;
+        if ((fd = open(ds.string, O_RDONLY)) < 0)
+            continue;
+        if (read(fd, magic, 4) == 4 &&
+            (!memcmp(magic, "\0\1\0\0", 4) || !memcmp(magic, "true", 4) ||
+             !memcmp(magic, "OTTO", 4) || !memcmp(magic, "ttcf", 4))) {
+            close(fd);
+            file = ns_strdup(ds.string);
+            Ns_DStringFree(&ds);
+            return file;
+        }
+        close(fd);
+        Ns_Log(Warning, "ns_chartdir: %s: not a font file", ds.string);
+    }
+    Ns_DStringFree(&ds);
+    return 0;
+}
+
+/*
+ * Resolves fonts listed in the config and draws a text with each one so
+ * ChartDirector loads them before the first request
+ */
+static void fontPreload(const char *list, const char *dirs)
+{
+    int argc, dirc = 0, isNew, count = 0;
+    const char **argv, **dirv = 0;
+    char *file;
+    Ns_Time start, end, diff;
+    Tcl_HashEntry *hPtr;
+    XYChart *chart;
+
+    if (!list || Tcl_SplitList(0, list, &argc, &argv) != TCL_OK)
+        return;
+    if (argc == 0) {
+        Tcl_Free((char *) argv);
+        return;
+    }
+    if (dirs && Tcl_SplitList(0, dirs, &dirc, &dirv) != TCL_OK)
+        dirc = 0;
+    Ns_GetTime(&start);
+    chart = XYChart::create(100, 100);
+    for (int i = 0; i < argc; i++) {
+        if (!(file = fontResolve(argv[i], dirc, dirv))) {
+            Ns_Log(Error, "ns_chartdir: font %s not found", argv[i]);
+            continue;
+        }
+        hPtr = Tcl_CreateHashEntry(&fontTable, argv[i], &isNew);
+        if (!isNew)
+            ns_free(Tcl_GetHashValue(hPtr));
+        Tcl_SetHashValue(hPtr, file);
+        chart->addText(0, 0, "0", file);
+        count++;
+    }
+    /* Nothing to draw if no font was found */
+    if (count)
+        chart->makeChart(PNG);
+    chart->destroy();
+    if (dirv)
+        Tcl_Free((char *) dirv);
+    Tcl_Free((char *) argv);
+    Ns_GetTime(&end);
+    Ns_DiffTime(&end, &start, &diff);
+    Ns_Log(Notice, "ns_chartdir: loaded %d of %d fonts in %ld.%06ld secs", count, argc, diff.sec, diff.usec);
+}
+
+/*
+ * Returns full path of the preloaded font or the name as is
+ */
+static const char *chartFont(const char *name)
+{
+    Tcl_HashEntry *hPtr;
+
+    if (!name || !fontTable.numEntries || !(hPtr = Tcl_FindHashEntry(&fontTable, name)))
+        return name;
+    return (const char *) Tcl_GetHashValue(hPtr);
+}
+
+/*
+ * Sends the image as the response
+ */
+static int chartReturnData(Ns_Conn * conn, const char *data, int len, const char *type)
+{
+    Ns_Time start;
+    int status;
+
+    chartPhaseStart(&start);
+    status = Ns_ConnReturnData(conn, 200, (char *) data, len, type);
+    chartPhaseEnd(PhaseReturn, &start);
+    return status;
+}
 
-extern "C" {
-#include "ns.h"
+/*
+ * Render thread, executes queued jobs and accounts queue wait and run time
+ */
+static void RenderThread(void *arg)
+{
+    ChartJob *job;
+    Ns_Time start, end, wait, run;
+    Tcl_Interp *interp = 0;
+
+    Ns_ThreadSetName("-nschartdir:render%ld-", (long) arg);
+    for (;;) {
+        Ns_MutexLock(&renderPool.lock);
+        while (!renderPool.head)
+            Ns_CondWait(&renderPool.cond, &renderPool.lock);
+        job = renderPool.head;
+        if (!(renderPool.head = job->next))
+            renderPool.tail = 0;
+        Ns_MutexUnlock(&renderPool.lock);
+
+        Ns_GetTime(&start);
+        Ns_DiffTime(&start, &job->queued, &wait);
+        if (!interp)
+            interp = Ns_TclAllocateInterp(chartServer);
+        job->proc(job, interp);
+        Ns_GetTime(&end);
+        Ns_DiffTime(&end, &start, &run);
+
+        Ns_MutexLock(&renderPool.lock);
+        renderPool.queued--;
+        renderPool.jobs++;
+        Ns_IncrTime(&renderPool.waittime, wait.sec, wait.usec);
+        Ns_IncrTime(&renderPool.rendertime, run.sec, run.usec);
+        if (Ns_DiffTime(&wait, &renderPool.maxwait, 0) > 0)
+            renderPool.maxwait = wait;
+        if (Ns_DiffTime(&run, &renderPool.maxrender, 0) > 0)
+            renderPool.maxrender = run;
+        Ns_MutexUnlock(&renderPool.lock);
+        ns_free(job->channel);
+        ns_free(job->headers);
+        ns_free(job->file);
+        ns_free(job);
+    }
 }
 
-#include "chartdir.h"
+/*
+ * Reserves place in the render queue, returns 0 if there are no render
+ * threads or the queue is full
+ */
+static int renderReserve(void)
+{
+    int ok;
+
+    Ns_MutexLock(&renderPool.lock);
+    ok = renderPool.threads > 0 && renderPool.queued < renderPool.maxqueue;
+    if (ok)
+        renderPool.queued++;
+    Ns_MutexUnlock(&renderPool.lock);
+    return ok;
+}
 
-#define _VERSION           "0.9.6"
+static void renderCancel(void)
+{
+    Ns_MutexLock(&renderPool.lock);
+    renderPool.queued--;
+    Ns_MutexUnlock(&renderPool.lock);
+}
 
-#define MAX_LAYERS         5
+// Queues job into reserved place
+static void renderQueue(ChartJob * job)
+{
+    job->next = 0;
+    Ns_GetTime(&job->queued);
+    Ns_MutexLock(&renderPool.lock);
+    if (renderPool.tail)
+        renderPool.tail->next = job;
+    else
+        renderPool.head = job;
+    renderPool.tail = job;
+    Ns_CondSignal(&renderPool.cond);
+    Ns_MutexUnlock(&renderPool.lock);
+}
 
-enum ChartType { XYChartType, PieChartType };
-enum LayerType { LineType, BarType, AreaType, TrendType, PieType };
+/*
+ * Callback which sends the rest of the response once the detached channel
+ * is writable, the rest is kept in nsv between calls
+ */
+static const char *chartChanFlush =
+    "{channel when} {\n"
+    "    set data [nsv_get nschartdir:return $channel]\n"
+    "    if { $when eq \"w\" && ![catch { ns_connchan write $channel $data } sent] &&\n"
+    "         $sent < [string length $data] } {\n"
+    "        nsv_set nschartdir:return $channel [string range $data $sent end]\n"
+    "        return 1\n"
+    "    }\n"
+    "    nsv_unset nschartdir:return $channel\n"
+    "    ns_connchan close $channel\n"
+    "    return 0\n"
+    "}";
+
+// Builds command list, caller appends arguments and releases it
+static Tcl_Obj *chartChanCmd(const char *cmd, const char *sub, const char *channel)
+{
+    Tcl_Obj *list = Tcl_NewListObj(0, 0);
 
-typedef struct _Chart {
-    struct _Chart *next, *prev;
-    unsigned long id;
-    time_t access_time;
-    ChartType type;
-    BaseChart *chart;
-    XYChart *xy;
-    PieChart *pie;
-    PlotArea *plotarea;
-    struct {
-        LayerType type;
-        Layer *layer;
-        BarLayer *bar;
-        LineLayer *line;
-        TrendLayer *trend;
-    } layers[MAX_LAYERS];
-} Ns_Chart;
+    Tcl_IncrRefCount(list);
+    Tcl_ListObjAppendElement(0, list, Tcl_NewStringObj(cmd, -1));
+    Tcl_ListObjAppendElement(0, list, Tcl_NewStringObj(sub, -1));
+    Tcl_ListObjAppendElement(0, list, Tcl_NewStringObj(channel, -1));
+    return list;
+}
 
-static int ChartCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONST objv[]);
-static int ChartInterpInit(Tcl_Interp * interp, const void *context);
-static void ChartGC(void *arg);
+/*
+ * Writes headers and image into detached connection and closes it. First
+ * write goes from both buffers to the socket without waiting, only what
+ * the socket does not accept is copied and handed to ns_connchan callback,
+ * so the render thread never waits for slow clients.
+ */
+static void chartChanWrite(Tcl_Interp * interp, ChartJob * job, const char *head, int hlen, const char *body, int blen)
+{
+    int rc;
+    ssize_t sent;
+    struct iovec iov[2];
+    Ns_Time timeout = { 0, 0 };
+    Tcl_Obj *cmd, *script, *rest;
+
+    iov[0].iov_base = (void *) head;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = (void *) body;
+    iov[1].iov_len = blen;
+    if ((sent = Ns_SockSendBufs(job->sock, iov, 2, &timeout, 0)) < 0) {
+        Ns_Log(Warning, "ns_chartdir: %s: write error: %s", job->channel, strerror(errno));
+        sent = hlen + blen;
+    }
 
-static Ns_Chart *chartList = 0;
-static Ns_Mutex chartMutex;
-static int chartIdleTimeout = 600;
-static int chartGCInterval = 600;
-static unsigned long chartID = 0;
+    if (sent < hlen + blen) {
+        rest = Tcl_NewByteArrayObj(0, 0);
+        unsigned char *bytes = Tcl_SetByteArrayLength(rest, hlen + blen - sent);
+        if (sent < hlen) {
+            memcpy(bytes, head + sent, hlen - sent);
+            memcpy(bytes + hlen - sent, body, blen);
+        } else
+            memcpy(bytes, body + sent - hlen, hlen + blen - sent);
+        cmd = chartChanCmd("nsv_set", "nschartdir:return", job->channel);
+        Tcl_ListObjAppendElement(0, cmd, rest);
+        rc = Tcl_EvalObjEx(interp, cmd, 0);
+        Tcl_DecrRefCount(cmd);
+        if (rc == TCL_OK) {
+            script = Tcl_NewListObj(0, 0);
+            Tcl_ListObjAppendElement(0, script, Tcl_NewStringObj("apply", -1));
+            Tcl_ListObjAppendElement(0, script, Tcl_NewStringObj(chartChanFlush, -1));
+            Tcl_ListObjAppendElement(0, script, Tcl_NewStringObj(job->channel, -1));
+            cmd = chartChanCmd("ns_connchan", "callback", job->channel);
+            Tcl_ListObjAppendElement(0, cmd, script);
+            Tcl_ListObjAppendElement(0, cmd, Tcl_NewStringObj("w", -1));
+            rc = Tcl_EvalObjEx(interp, cmd, 0);
+            Tcl_DecrRefCount(cmd);
+        }
+        if (rc == TCL_OK) {
+            Tcl_ResetResult(interp);
+            return;
+        }
+        Ns_Log(Warning, "ns_chartdir: %s: callback error: %s", job->channel, Tcl_GetStringResult(interp));
+        cmd = chartChanCmd("nsv_unset", "-nocomplain", "nschartdir:return");
+        Tcl_ListObjAppendElement(0, cmd, Tcl_NewStringObj(job->channel, -1));
+        Tcl_EvalObjEx(interp, cmd, 0);
+        Tcl_DecrRefCount(cmd);
+    }
+    cmd = chartChanCmd("ns_connchan", "close", job->channel);
+    Tcl_EvalObjEx(interp, cmd, 0);
+    Tcl_DecrRefCount(cmd);
+    Tcl_ResetResult(interp);
+}
 
-static const char *chartAligments[] = { "Bottom", "2",
-    "BottomLeft", "1",
-    "BottomCenter", "2",
-    "BottomRight", "3",
-    "Left", "4",
-    "Center", "5",
-    "Right", "6",
-    "Top", "8",
-    "TopLeft", "7",
-    "TopCenter", "8",
-    "TopRight", "9",
-    0
-};
+/*
+ * Renders chart and sends it into detached connection, status line and
+ * headers were built by the server before detaching, only Content-Length
+ * is added here. The chart stays locked while written, the image buffer
+ * may belong to the chart when the cache is disabled.
+ */
+static void chartReturnJob(ChartJob * job, Tcl_Interp * interp)
+{
+    Ns_Time start;
+    MemBlock mem;
+    ChartImage *image;
+    Ns_DString ds;
+
+    Ns_MutexLock(&job->chart->lock);
+    image = chartImage(job->chart, &job->fmt, &mem);
+    Ns_DStringInit(&ds);
+    Ns_DStringPrintf(&ds, "%sContent-Length: %d\r\n\r\n", job->headers, mem.len);
+    chartPhaseStart(&start);
+    chartChanWrite(interp, job, ds.string, ds.length, mem.data, mem.len);
+    chartPhaseEnd(PhaseReturn, &start);
+    Ns_MutexUnlock(&job->chart->lock);
+    Ns_DStringFree(&ds);
+    if (image)
+        releaseImage(image);
+    releaseChart(job->chart);
+}
 
-static const char *chartLineTypes[] = { "DashLine", "1285",     // 0x505
-    "DotLine", "514",           // 0x202
-    "DotDashLine", "84214277",  // 0x05050205
-    "AltDashLine", "168101125", // 0x0A050505
-    0
-};
+/*
+ * Hands chart over to the render pool which sends the response, connection
+ * is detached so the connection thread is free immediately. Returns 0 if
+ * the pool is not available and the chart should be returned synchronously.
+ */
+static int chartReturnAsync(Ns_Chart * chart, ChartFormat * fmt, Tcl_Interp * interp)
+{
+    ChartJob *job;
+    Ns_DString ds;
+    Ns_Conn *conn = Ns_TclGetConn(interp);
+    Ns_Sock *sock = Ns_ConnSockPtr(conn);
 
-static const char *chartSymbolTypes[] = { "NoSymbol",
-    "SquareSymbol",
-    "DiamondSymbol",
-    "TriangleSymbol",
-    "RightTriangleSymbol",
-    "LeftTriangleSymbol",
-    "InvertedTriangleSymbol",
-    "CircleSymbol",
-    "CrossSymbol",
-    "Cross2Symbol",
-    0
-};
+    if (!sock || !renderReserve())
+        return 0;
 
-static const char *chartDataCombineMethods[] = { "Overlay", "Stack", "Depth", "Side", 0 };
+    /* Headers are built while the connection is still attached, the
+     * connection is closed after the image, length is not known yet */
+    Ns_ConnSetTypeHeader(conn, chartFormats[fmt->format].type);
+    Ns_ConnSetHeaders(conn, "Connection", "close");
+    Ns_DStringInit(&ds);
+    Ns_ConnConstructHeaders(conn, &ds);
+    if (ds.length >= 2 && !strcmp(ds.string + ds.length - 2, "\r\n"))
+        Ns_DStringSetLength(&ds, ds.length - 2);
+
+    /* Socket stays open and owned by the channel until ns_connchan close */
+    if (Tcl_EvalEx(interp, "ns_connchan detach", -1, 0) != TCL_OK) {
+        Ns_Log(Warning, "ns_chartdir: return -async: %s", Tcl_GetStringResult(interp));
+        Tcl_ResetResult(interp);
+        Ns_DStringFree(&ds);
+        renderCancel();
+        return 0;
+    }
+    job = (ChartJob *) ns_calloc(1, sizeof(ChartJob));
+    job->proc = chartReturnJob;
+    job->channel = ns_strdup(Tcl_GetStringResult(interp));
+    job->headers = ns_strdup(ds.string);
+    job->sock = sock;
+    job->chart = chart;
+    job->fmt = *fmt;
+    retainChart(chart);
+    Ns_DStringFree(&ds);
+    Tcl_ResetResult(interp);
+    renderQueue(job);
+    return 1;
+}
 
-static const char *chartLegendModes[] = { "NormalLegend", "ReverseLegend", "NoLegend", 0 };
+/*
+ * Renders chart and saves it into the file
+ */
+static void chartSaveJob(ChartJob * job, Tcl_Interp * interp)
+{
+    MemBlock mem;
+    ChartImage *image;
+    int err = 0;
+
+    Ns_MutexLock(&job->chart->lock);
+    image = chartImage(job->chart, &job->fmt, &mem);
+    if (chartWriteFile(job->file, mem.data, mem.len) != 0)
+        err = errno;
+    Ns_MutexUnlock(&job->chart->lock);
+    if (err)
+        Ns_Log(Error, "ns_chartdir: save -async: %s: %s", job->file, strerror(err));
+    if (image)
+        releaseImage(image);
+    releaseChart(job->chart);
+}
 
-extern "C" {
+/*
+ * Queues saving of the chart to the render pool, returns 0 if the pool is
+ * not available
+ */
+static int chartSaveAsync(Ns_Chart * chart, const char *file, ChartFormat * fmt)
+{
+    ChartJob *job;
 
-    NS_EXPORT int Ns_ModuleVersion = 1;
+    if (!renderReserve())
+        return 0;
+    job = (ChartJob *) ns_calloc(1, sizeof(ChartJob));
+    job->proc = chartSaveJob;
+    job->file = ns_strdup(file);
+    job->chart = chart;
+    job->fmt = *fmt;
+    retainChart(chart);
+    renderQueue(job);
+    return 1;
+}
 
 /*
- * Load the config parameters, setup the structures
+ * Renders one chart of the batch into a blob or the file in batch dir
  */
+static void chartBatchDone(ChartBatch * batch, int index, ChartImage * image, int err);
 
-    NS_EXPORT int Ns_ModuleInit(const char *server, const char *module) {
-        const char *path;
+static void chartBatchJob(ChartJob * job, Tcl_Interp * interp)
+{
+    ChartBatch *batch = job->batch;
+    ChartImage *image;
+    MemBlock mem;
+    int err = 0;
+
+    Ns_MutexLock(&job->chart->lock);
+    image = chartImage(job->chart, &job->fmt, &mem);
+    if (!mem.data)
+        err = EIO;
+    else if (batch->dir) {
+        if (chartWriteFile(job->file, mem.data, mem.len) != 0)
+            err = errno;
+    } else if (!image)
+        image = newImage(&mem, &job->fmt);
+    Ns_MutexUnlock(&job->chart->lock);
+    releaseChart(job->chart);
+    /* Files are written, only image blobs are kept */
+    if (image && (batch->dir || err)) {
+        releaseImage(image);
+        image = 0;
+    }
+    chartBatchDone(batch, job->index, image, err);
+}
 
-         Ns_Log(Notice, "nschartdir module version %s server: %s", _VERSION, server);
+static void chartBatchDone(ChartBatch * batch, int index, ChartImage * image, int err)
+{
+    Ns_MutexLock(&batch->lock);
+    batch->images[index] = image;
+    batch->errors[index] = err;
+    if (--batch->pending == 0)
+        Ns_CondBroadcast(&batch->cond);
+    Ns_MutexUnlock(&batch->lock);
+}
 
-         path = Ns_ConfigGetPath(server, module, NULL);
-         Ns_ConfigGetInt(path, "idle_timeout", &chartIdleTimeout);
-         Ns_ConfigGetInt(path, "gc_interval", &chartGCInterval);
-        /* Schedule garbage collection proc for automatic chart close/cleanup */
-        if (chartGCInterval > 0) {
-            Ns_Time interval;
-            interval.sec = chartGCInterval;  interval.usec = 0;
-            Ns_ScheduleProcEx((Ns_SchedProc *)ChartGC, 0, NS_SCHED_THREAD, &interval, NULL);
-            Ns_Log(Notice, "ns_chartdir: scheduling GC proc for every %d secs", chartGCInterval);
+/*
+ * ns_chartdir renderbatch {#chart ...} ?-format format? ?-quality n? ?-dir dir?
+ *
+ * Charts are queued to the render pool, the ones which do not fit into the
+ * queue are rendered by the caller in render slots while the pool works on
+ * the rest. Returns list of image blobs or, with -dir, list of written
+ * files named by chart position in the list.
+ */
+static int RenderBatchCmd(ChartInterp * data, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
+{
+    int i, rc, argc, count = 0, busy = 0, result = TCL_OK;
+    Tcl_Obj **argv, *list;
+    ChartFormat fmt = { 0, 0 };
+    ChartJob *job, *inline_jobs = 0;
+    ChartBatch batch;
+    Ns_Chart **charts;
+
+    if (objc < 3 || Tcl_ListObjGetElements(interp, objv[2], &argc, &argv) != TCL_OK) {
+        Tcl_WrongNumArgs(interp, 2, objv, "{#chart ...} ?-format format? ?-quality n? ?-dir dir?");
+        return TCL_ERROR;
+    }
+    memset(&batch, 0, sizeof(batch));
+    for (i = 3; i < objc; i++) {
+        if ((rc = chartFormatOption(interp, objc, objv, &i, &fmt)) < 0)
+            return TCL_ERROR;
+        if (rc > 0)
+            continue;
+        if (!strcmp(Tcl_GetStringFromObj(objv[i], 0), "-dir") && i + 1 < objc) {
+            batch.dir = Tcl_GetStringFromObj(objv[++i], 0);
+            continue;
         }
-        Ns_MutexSetName2(&chartMutex, "nschartdir", "chart");
-        Ns_TclRegisterTrace(server, ChartInterpInit, 0, NS_TCL_TRACE_CREATE);
-        return NS_OK;
+        Tcl_AppendResult(interp, "wrong option: should be -dir, -format or -quality", 0);
+        return TCL_ERROR;
     }
 
+    /* All charts are pinned before any job is started */
+    charts = (Ns_Chart **) ns_calloc(argc + 1, sizeof(Ns_Chart *));
+    for (count = 0; count < argc; count++) {
+        if (!(charts[count] = chartFromObj(data, argv[count], interp))) {
+            while (count-- > 0)
+                releaseChart(charts[count]);
+            ns_free(charts);
+            return TCL_ERROR;
+        }
+    }
+    batch.images = (ChartImage **) ns_calloc(argc + 1, sizeof(ChartImage *));
+    batch.errors = (int *) ns_calloc(argc + 1, sizeof(int));
+    batch.pending = argc;
+    Ns_MutexInit(&batch.lock);
+    Ns_CondInit(&batch.cond);
+    list = Tcl_NewListObj(0, 0);
+    Tcl_IncrRefCount(list);
+
+    for (i = 0; i < argc; i++) {
+        job = (ChartJob *) ns_calloc(1, sizeof(ChartJob));
+        job->proc = chartBatchJob;
+        job->chart = charts[i];
+        job->fmt = fmt;
+        job->batch = &batch;
+        job->index = i;
+        if (batch.dir) {
+            Tcl_Obj *file = Tcl_NewStringObj(batch.dir, -1);
+            Tcl_AppendPrintfToObj(file, "/%d.%s", i, chartFormats[fmt.format].name);
+            Tcl_ListObjAppendElement(interp, list, file);
+            job->file = ns_strdup(Tcl_GetString(file));
+        }
+        if (renderReserve())
+            renderQueue(job);
+        else {
+            job->next = inline_jobs;
+            inline_jobs = job;
+        }
+    }
+    while ((job = inline_jobs)) {
+        inline_jobs = job->next;
+        /* Rendered by the caller, so admission control applies */
+        if (!busy && renderAdmit(interp) == TCL_OK) {
+            chartBatchJob(job, interp);
+            renderRelease();
+        } else {
+            busy = 1;
+            releaseChart(job->chart);
+            chartBatchDone(&batch, job->index, 0, EBUSY);
+        }
+        ns_free(job->file);
+        ns_free(job);
+    }
+    Ns_MutexLock(&batch.lock);
+    while (batch.pending > 0)
+        Ns_CondWait(&batch.cond, &batch.lock);
+    Ns_MutexUnlock(&batch.lock);
+
+    /* Busy error is already in the interp result */
+    if (busy)
+        result = TCL_ERROR;
+    for (i = 0; i < argc; i++) {
+        if (batch.errors[i] && result == TCL_OK) {
+            if (batch.dir) {
+                Tcl_Obj *file;
+                Tcl_ListObjIndex(0, list, i, &file);
+                Tcl_AppendResult(interp, Tcl_GetString(file), ": ", strerror(batch.errors[i]), 0);
+            } else
+                Tcl_AppendResult(interp, Tcl_GetString(argv[i]), ": render failed", 0);
+            result = TCL_ERROR;
+        }
+        if (batch.images[i]) {
+            if (result == TCL_OK)
+                Tcl_ListObjAppendElement(interp, list, newImageObj(batch.images[i]));
+            else
+                releaseImage(batch.images[i]);
+        }
+    }
+    if (result == TCL_OK)
+        Tcl_SetObjResult(interp, list);
+    Tcl_DecrRefCount(list);
+    Ns_CondDestroy(&batch.cond);
+    Ns_MutexDestroy(&batch.lock);
+    ns_free(batch.images);
+    ns_free(batch.errors);
+    ns_free(charts);
+    return result;
 }
 
 /*
- * Add ns_chartdir commands to interp.
+ * ns_chartdir composite {#chart ...} ?-columns n? ?-gap px? ?-bgcolor color?
+ *     ?-format format? ?-quality n? ?-blob?
+ *
+ * Draws charts into one image laid out in a grid, columns are as wide as
+ * the widest chart in them, rows as high as the highest one. Returns list
+ * of the image and tiles as { id x y width height } ...
  */
-static int ChartInterpInit(Tcl_Interp * interp, const void *context)
+static int CompositeCmd(ChartInterp * data, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
 {
-    Tcl_CreateObjCommand(interp, "ns_chartdir", ChartCmd, NULL, NULL);
-    return NS_OK;
+    int i, rc, argc, count, columns = 0, rows, gap = 0, bgcolor = 0xFFFFFF, blob = 0;
+    int width, height, *widths, *heights, *colx, *rowy;
+    Tcl_Obj **argv, *tiles, *result;
+    ChartFormat fmt = { 0, 0 };
+    Ns_Chart **charts;
+    DrawArea *area;
+    MemBlock mem;
+    Ns_Time start;
+
+    if (objc < 3 || Tcl_ListObjGetElements(interp, objv[2], &argc, &argv) != TCL_OK || argc == 0) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+                         "{#chart ...} ?-columns n? ?-gap px? ?-bgcolor color? ?-format format? ?-quality n? ?-blob?");
+        return TCL_ERROR;
+    }
+    for (i = 3; i < objc; i++) {
+        char *opt = Tcl_GetStringFromObj(objv[i], 0);
+
+        if ((rc = chartFormatOption(interp, objc, objv, &i, &fmt)) < 0)
+            return TCL_ERROR;
+        if (rc > 0)
+            continue;
+        if (!strcmp(opt, "-blob"))
+            blob = 1;
+        else if (!strcmp(opt, "-columns") && i + 1 < objc) {
+            if (Tcl_GetIntFromObj(interp, objv[++i], &columns) != TCL_OK)
+                return TCL_ERROR;
+        } else if (!strcmp(opt, "-gap") && i + 1 < objc) {
+            if (Tcl_GetIntFromObj(interp, objv[++i], &gap) != TCL_OK)
+                return TCL_ERROR;
+        } else if (!strcmp(opt, "-bgcolor") && i + 1 < objc) {
+            if (chartColor(interp, objv[++i], &bgcolor) != TCL_OK)
+                return TCL_ERROR;
+        } else {
+            Tcl_AppendResult(interp, "wrong option \"", opt,
+                             "\": should be -columns, -gap, -bgcolor, -format, -quality or -blob", 0);
+            return TCL_ERROR;
+        }
+    }
+    if (chartFormats[fmt.format].format == SVG) {
+        Tcl_AppendResult(interp, "composite image cannot be svg", 0);
+        return TCL_ERROR;
+    }
+    if (columns <= 0)
+        for (columns = 1; columns * columns < argc; columns++);
+    rows = (argc + columns - 1) / columns;
+
+    charts = (Ns_Chart **) ns_calloc(argc, sizeof(Ns_Chart *));
+    for (count = 0; count < argc; count++) {
+        if (!(charts[count] = chartFromObj(data, argv[count], interp))) {
+            while (count-- > 0)
+                releaseChart(charts[count]);
+            ns_free(charts);
+            return TCL_ERROR;
+        }
+    }
+
+    /* Grid layout by chart sizes */
+    widths = (int *) ns_calloc(2 * argc + columns + rows + 2, sizeof(int));
+    heights = widths + argc;
+    colx = heights + argc;
+    rowy = colx + columns + 1;
+    for (i = 0; i < argc; i++) {
+        Ns_MutexLock(&charts[i]->lock);
+        widths[i] = charts[i]->chart->getWidth();
+        heights[i] = charts[i]->chart->getHeight();
+        Ns_MutexUnlock(&charts[i]->lock);
+        if (colx[i % columns + 1] < widths[i] + gap)
+            colx[i % columns + 1] = widths[i] + gap;
+        if (rowy[i / columns + 1] < heights[i] + gap)
+            rowy[i / columns + 1] = heights[i] + gap;
+    }
+    for (i = 1; i <= columns; i++)
+        colx[i] += colx[i - 1];
+    for (i = 1; i <= rows; i++)
+        rowy[i] += rowy[i - 1];
+    width = colx[columns] - gap;
+    height = rowy[rows] - gap;
+
+    if (chartLimitSize(interp, width, height) != TCL_OK || renderAdmit(interp) != TCL_OK) {
+        for (i = 0; i < argc; i++)
+            releaseChart(charts[i]);
+        ns_free(widths);
+        ns_free(charts);
+        return TCL_ERROR;
+    }
+    /* Layout of every tile and merging counts as one layout */
+    chartPhaseStart(&start);
+    area = new DrawArea();
+    area->setSize(width, height, bgcolor);
+    tiles = Tcl_NewListObj(0, 0);
+    for (i = 0; i < argc; i++) {
+        int x = colx[i % columns], y = rowy[i / columns];
+
+        Ns_MutexLock(&charts[i]->lock);
+        area->merge(charts[i]->chart->makeChart(), x, y, TopLeft, 0);
+        Ns_MutexUnlock(&charts[i]->lock);
+
+        Tcl_Obj *tile = Tcl_NewListObj(0, 0);
+        Tcl_ListObjAppendElement(interp, tile, Tcl_NewLongObj(charts[i]->id));
+        Tcl_ListObjAppendElement(interp, tile, Tcl_NewIntObj(x));
+        Tcl_ListObjAppendElement(interp, tile, Tcl_NewIntObj(y));
+        Tcl_ListObjAppendElement(interp, tile, Tcl_NewIntObj(widths[i]));
+        Tcl_ListObjAppendElement(interp, tile, Tcl_NewIntObj(heights[i]));
+        Tcl_ListObjAppendElement(interp, tiles, tile);
+        releaseChart(charts[i]);
+    }
+    chartPhaseEnd(PhaseLayout, &start);
+
+    mem = areaEncode(area, &fmt);
+    renderRelease();
+    result = Tcl_NewListObj(0, 0);
+    Tcl_ListObjAppendElement(interp, result, chartImageObj(0, &mem, &fmt, blob));
+    Tcl_ListObjAppendElement(interp, result, tiles);
+    Tcl_SetObjResult(interp, result);
+    delete area;
+    ns_free(widths);
+    ns_free(charts);
+    return TCL_OK;
 }
 
-static Ns_Chart *getChart(unsigned long id)
+/*
+ * Scheduled script, runs in its own thread with server interp
+ */
+static void ChartScheduleProc(void *arg, int id)
 {
-    Ns_Chart *chart;
+    ChartSchedule *sched = (ChartSchedule *) arg;
+    Tcl_Interp *interp;
 
-    Ns_MutexLock(&chartMutex);
-    for (chart = chartList; chart; chart = chart->next)
-        if (chart->id == id)
-            break;
-    Ns_MutexUnlock(&chartMutex);
-    return chart;
+    if ((interp = Ns_TclAllocateInterp(chartServer))) {
+        if (Tcl_EvalEx(interp, sched->script, -1, 0) != TCL_OK)
+            Ns_TclLogErrorInfo(interp, "\n(context: ns_chartdir schedule)");
+        Ns_TclDeAllocateInterp(interp);
+    }
 }
 
-static void freeChart(Ns_Chart * chart, int lock)
+// Called by the scheduler when cancelled event is not running anymore
+static void ChartScheduleFree(void *arg, int id)
 {
-    if (!chart)
-        return;
+    ChartSchedule *sched = (ChartSchedule *) arg;
 
-    if (lock)
-        Ns_MutexLock(&chartMutex);
-    if (chart->prev)
-        chart->prev->next = chart->next;
-    if (chart->next)
-        chart->next->prev = chart->prev;
-    if (chart == chartList)
-        chartList = chart->next;
-    if (lock)
-        Ns_MutexUnlock(&chartMutex);
-    chart->chart->destroy();
-    ns_free(chart);
+    ns_free(sched->script);
+    ns_free(sched);
 }
 
-// Garbage collection routine, closes expired charts
-static void ChartGC(void *arg)
+/*
+ * ns_chartdir schedule ?name interval ?script??
+ *
+ * Without arguments returns list of scheduled scripts with intervals,
+ * interval 0 cancels the script
+ */
+static int ScheduleCmd(int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
 {
-    Ns_Chart *chart;
-    time_t now = time(0);
-
-    Ns_MutexLock(&chartMutex);
-    for (chart = chartList; chart;) {
-        if (now - chart->access_time > chartIdleTimeout) {
-            Ns_Chart *next = chart->next;
-            Ns_Log(Notice, "ns_chartdir: GC: inactive chart %ld", chart->id);
-            freeChart(chart, 0);
-            chart = next;
-            continue;
+    int isNew, interval, id = 0;
+    Ns_Time time;
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+    ChartSchedule *sched;
+
+    if (objc == 2) {
+        Tcl_Obj *list = Tcl_NewListObj(0, 0);
+
+        Ns_MutexLock(&scheduleMutex);
+        for (hPtr = Tcl_FirstHashEntry(&scheduleTable, &search); hPtr; hPtr = Tcl_NextHashEntry(&search)) {
+            sched = (ChartSchedule *) Tcl_GetHashValue(hPtr);
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj((char *) Tcl_GetHashKey(&scheduleTable, hPtr), -1));
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewIntObj(sched->interval));
         }
-        chart = chart->next;
+        Ns_MutexUnlock(&scheduleMutex);
+        Tcl_SetObjResult(interp, list);
+        return TCL_OK;
     }
-    Ns_MutexUnlock(&chartMutex);
+    if (objc < 4 || Tcl_GetIntFromObj(interp, objv[3], &interval) != TCL_OK || (interval > 0 && objc < 5)) {
+        Tcl_WrongNumArgs(interp, 2, objv, "?name interval ?script??");
+        return TCL_ERROR;
+    }
+    sched = 0;
+    if (interval > 0) {
+        sched = (ChartSchedule *) ns_calloc(1, sizeof(ChartSchedule));
+        sched->interval = interval;
+        sched->script = ns_strdup(Tcl_GetStringFromObj(objv[4], 0));
+        time.sec = interval;
+        time.usec = 0;
+    }
+
+    Ns_MutexLock(&scheduleMutex);
+    if ((hPtr = Tcl_FindHashEntry(&scheduleTable, Tcl_GetStringFromObj(objv[2], 0)))) {
+        Ns_Cancel(((ChartSchedule *) Tcl_GetHashValue(hPtr))->id);
+        Tcl_DeleteHashEntry(hPtr);
+    }
+    if (sched && (id = Ns_ScheduleProcEx(ChartScheduleProc, sched, NS_SCHED_THREAD, &time, ChartScheduleFree)) >= 0) {
+        sched->id = id;
+        hPtr = Tcl_CreateHashEntry(&scheduleTable, Tcl_GetStringFromObj(objv[2], 0), &isNew);
+        Tcl_SetHashValue(hPtr, sched);
+    }
+    Ns_MutexUnlock(&scheduleMutex);
+    if (id < 0) {
+        ns_free(sched->script);
+        ns_free(sched);
+        Tcl_AppendResult(interp, "cannot schedule script", 0);
+        return TCL_ERROR;
+    }
+    return TCL_OK;
 }
 
 static Alignment chartAlignment(const char *name, Alignment defalign = Center)
@@ -248,7 +3013,7 @@ static int chartColor(Tcl_Interp * interp, Tcl_Obj * obj, int *color)
     return TCL_OK;
 }
 
-static Ns_Chart *createChart(int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
+static int createChart(ChartInterp * data, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
 {
     Ns_Chart *chart;
     char *type;
@@ -257,21 +3022,60 @@ static Ns_Chart *createChart(int objc, Tcl_Obj * CONST objv[], Tcl_Interp * inte
     int bgcolor = 0xFFFFFF;
     int edgecolor = -1;
     int border = 0;
-
+    int scope = chartRequestScope && Ns_TclGetConn(interp) ? RequestScope : GlobalScope;
+    Tcl_Obj *CONST *args = objv;
+    Tcl_Obj *targs[16], *tmplArgs = 0, **argv;
+    ChartTemplate *tmpl = 0;
+    int argc;
+
+    while (objc > 3) {
+        char *opt = Tcl_GetStringFromObj(args[2], 0);
+
+        if (!strcmp(opt, "-scope")) {
+            static const char *scopes[] = { "global", "request", 0 };
+            if (Tcl_GetIndexFromObj(interp, args[3], scopes, "scope", 0, &scope) != TCL_OK)
+                goto error;
+        } else if (!strcmp(opt, "-template")) {
+            if (tmpl)
+                releaseTemplate(tmpl);
+            if (!(tmpl = getTemplate(Tcl_GetStringFromObj(args[3], 0)))) {
+                Tcl_AppendResult(interp, "unknown template \"", Tcl_GetStringFromObj(args[3], 0), "\"", 0);
+                goto error;
+            }
+        } else
+            break;
+        args += 2;
+        objc -= 2;
+    }
+    /* Without explicit arguments chart is created with template arguments */
+    if (tmpl && objc == 2) {
+        tmplArgs = Tcl_NewStringObj(tmpl->create, -1);
+        Tcl_IncrRefCount(tmplArgs);
+        if (Tcl_ListObjGetElements(interp, tmplArgs, &argc, &argv) != TCL_OK || argc > 14)
+            goto error;
+        targs[0] = args[0];
+        targs[1] = args[1];
+        memcpy(targs + 2, argv, argc * sizeof(Tcl_Obj *));
+        args = targs;
+        objc = argc + 2;
+    }
     if (objc < 5 ||
-        !(type = Tcl_GetStringFromObj(objv[2], 0)) ||
-        Tcl_GetIntFromObj(interp, objv[3], &width) != TCL_OK ||
-        Tcl_GetIntFromObj(interp, objv[4], &height) != TCL_OK ||
-        (objc > 5 && chartColor(interp, objv[5], &bgcolor) != TCL_OK) ||
-        (objc > 6 && chartColor(interp, objv[6], &edgecolor) != TCL_OK) ||
-        (objc > 7 && Tcl_GetIntFromObj(interp, objv[7], &border) != TCL_OK)) {
-        Tcl_WrongNumArgs(interp, 2, objv, "type width height ?bgcolor? ?edgecolor? ?border?");
-        return 0;
+        !(type = Tcl_GetStringFromObj(args[2], 0)) ||
+        Tcl_GetIntFromObj(interp, args[3], &width) != TCL_OK ||
+        Tcl_GetIntFromObj(interp, args[4], &height) != TCL_OK ||
+        (objc > 5 && chartColor(interp, args[5], &bgcolor) != TCL_OK) ||
+        (objc > 6 && chartColor(interp, args[6], &edgecolor) != TCL_OK) ||
+        (objc > 7 && Tcl_GetIntFromObj(interp, args[7], &border) != TCL_OK)) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+                         "?-scope global|request? ?-template name? type width height ?bgcolor? ?edgecolor? ?border?");
+        goto error;
     }
-    chart = (Ns_Chart *) ns_calloc(1, sizeof(Ns_Chart));
-    Ns_MutexLock(&chartMutex);
-    chart->id = ++chartID;
-    Ns_MutexUnlock(&chartMutex);
+    if (chartLimitSize(interp, width, height) != TCL_OK)
+        goto error;
+    chart = allocChart();
+    chart->scope = (ChartScope) scope;
+    chart->hash = CHART_HASH_BASIS;
+    chartHashObjs(chart, objc - 2, args + 2);
 
     if (!strcasecmp(type, "pie")) {
         chart->pie = PieChart::create(width, height);
@@ -283,18 +3087,84 @@ static Ns_Chart *createChart(int objc, Tcl_Obj * CONST objv[], Tcl_Interp * inte
         chart->type = XYChartType;
     }
     chart->chart->setBackground(bgcolor, edgecolor, border);
+    chartResize(chart, width, height);
+    chart->plotwidth = 0;
+    chart->access_time = chart->queue_time = time(0);
+
+    if (tmpl) {
+        if (applyTemplate(chart, tmpl, interp) != TCL_OK) {
+            destroyChart(chart);
+            goto error;
+        }
+        Tcl_ResetResult(interp);
+    }
 
-    /* Link new chart to global chart list */
-    Ns_MutexLock(&chartMutex);
-    chart->next = chartList;
-    if (chartList)
-        chartList->prev = chart;
-    chartList = chart;
-    chart->access_time = time(0);
-    Ns_MutexUnlock(&chartMutex);
-    /* Return chart id */
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(chart->id));
-    return chart;
+    chartStore(&chart->generation, __atomic_add_fetch(&chartGeneration, 1UL, __ATOMIC_ACQ_REL));
+    /* Registry reference and the creator pin, held until the handle is
+     * built so eviction, GC or destroy by id cannot free the chart first */
+    chartStore(&chart->refcount, 2);
+
+    /* Template is being defined, this chart records commands */
+    if (data->recording && !data->recordChart) {
+        Tcl_Obj *list = Tcl_NewListObj(objc - 2, args + 2);
+        data->recording->create = ns_strdup(Tcl_GetString(list));
+        Tcl_DecrRefCount(list);
+        for (int i = 0; tmpl && i < tmpl->count; i++) {
+            list = Tcl_NewStringObj(tmpl->cmds[i].args, -1);
+            templateAppend(data->recording, tmpl->cmds[i].name, tmpl->cmds[i].proc, list);
+            Tcl_DecrRefCount(list);
+        }
+        data->recordChart = chart;
+        chart->recording = data->recording;
+        retainChart(chart);
+    }
+
+    if (chart->scope == RequestScope) {
+        /* Request charts are owned by the interp and use negative ids */
+        int isNew;
+        chart->id = --data->nextId;
+        chart->owner = data;
+        Tcl_SetHashValue(Tcl_CreateHashEntry(&data->charts, (char *) chart->id, &isNew), chart);
+    } else {
+        /* Register new chart in its shard */
+        int isNew;
+        ChartShard *shard;
+
+        chart->id = __atomic_add_fetch(&chartID, 1L, __ATOMIC_ACQ_REL);
+        shard = chartShard(chart->id);
+
+        /* Template chart being recorded is pinned, it does not count */
+        if (!chart->recording) {
+            chart->budget = 1;
+            chartCount(&chartMemory, chart->size);
+        }
+
+        chartLock(&shard->lock, &chartShardBusy);
+        Tcl_SetHashValue(Tcl_CreateHashEntry(&shard->charts, (char *) chart->id, &isNew), chart);
+        chartAppend(shard, chart);
+        Ns_MutexUnlock(&shard->lock);
+        chartCount(&chartLive, 1L);
+
+        /* Pinned, the new chart itself is not evicted */
+        if (chartOverBudget())
+            chartEvict();
+    }
+    if (tmpl)
+        releaseTemplate(tmpl);
+    if (tmplArgs)
+        Tcl_DecrRefCount(tmplArgs);
+
+    /* Return chart handle */
+    Tcl_SetObjResult(interp, newChartObj(chart));
+    releaseChart(chart);
+    return TCL_OK;
+
+  error:
+    if (tmpl)
+        releaseTemplate(tmpl);
+    if (tmplArgs)
+        Tcl_DecrRefCount(tmplArgs);
+    return TCL_ERROR;
 }
 
 static int setBackground(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
@@ -323,7 +3193,10 @@ static int setSize(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Inter
         Tcl_WrongNumArgs(interp, 2, objv, "#chart width height");
         return TCL_ERROR;
     }
+    if (chartLimitSize(interp, width, height) != TCL_OK)
+        return TCL_ERROR;
     chart->chart->setSize(width, height);
+    chartResize(chart, width, height);
     return TCL_OK;
 }
 
@@ -351,6 +3224,7 @@ static int setPlotArea(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_I
         return TCL_ERROR;
     }
     chart->plotarea = chart->xy->setPlotArea(x, y, width, height, bgcolor, abgcolor, edgecolor, hgridcolor, vgridcolor);
+    chart->plotwidth = width;
     return TCL_OK;
 }
 
@@ -381,7 +3255,7 @@ static int addLegend(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Int
                          "#chart x y ?vertical? ?bgcolor? ?edgecolor? ?font? ?fontheight? ?fontcolor? ?fontangle? ?align?");
         return TCL_ERROR;
     }
-    chart->chart->addLegend(x, y, (bool) vertical, font, fontheight);
+    chart->chart->addLegend(x, y, (bool) vertical, chartFont(font), fontheight);
     chart->chart->getLegend()->setBackground(bgcolor, edgecolor);
     chart->chart->getLegend()->setFontColor(fontcolor);
     if (align)
@@ -415,7 +3289,7 @@ static int addTitle(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Inte
                          "#chart title ?alignment? ?font? ?fontheight? ?fontcolor? ?bgcolor? ?edgecolor? ?border?");
         return TCL_ERROR;
     }
-    chart->chart->addTitle(chartAlignment(align), title, font, fontheight, fontcolor)->setBackground(bgcolor, edgecolor,
+    chart->chart->addTitle(chartAlignment(align), title, chartFont(font), fontheight, fontcolor)->setBackground(bgcolor, edgecolor,
                                                                                                      border);
     return TCL_OK;
 }
@@ -431,6 +3305,7 @@ static int setBgImage(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_In
     }
     if (objc > 4)
         align = chartAlignment(Tcl_GetStringFromObj(objv[4], 0));
+    image = chartAsset(chart, image);
     if (objc < 6)
         chart->chart->setBgImage(image, align);
     else if (chart->plotarea)
@@ -480,7 +3355,7 @@ static int setWallpaper(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_
         Tcl_WrongNumArgs(interp, 2, objv, "#chart name");
         return TCL_ERROR;
     }
-    chart->chart->setWallpaper(image);
+    chart->chart->setWallpaper(chartAsset(chart, image));
     return TCL_OK;
 }
 
@@ -507,7 +3382,7 @@ static int XAxisCmd(int second, Ns_Chart * chart, int objc, Tcl_Obj * CONST objv
         Tcl_AppendResult(interp, "wrong chart type", 0);
         return TCL_ERROR;
     }
-    if (objc < 2) {
+    if (objc < 5) {
         Tcl_WrongNumArgs(interp, 2, objv, "#chart command ...");
         return TCL_ERROR;
     }
@@ -599,7 +3474,7 @@ static int XAxisCmd(int second, Ns_Chart * chart, int objc, Tcl_Obj * CONST objv
                                  "value linecolor linewidth text ?align? ?font? ?fontsize? ?fontcolor? ?fontangle? ?ontop? ?tickcolor?");
                 return TCL_ERROR;
             }
-            Mark *mark = xaxis->addMark(value, linecolor, text, font, fontsize);
+            Mark *mark = xaxis->addMark(value, linecolor, text, chartFont(font), fontsize);
             mark->setLineWidth(linewidth);
             mark->setMarkColor(linecolor, fontcolor, tickcolor ? tickcolor : linecolor);
             mark->setAlignment(chartAlignment(align, TopCenter));
@@ -648,7 +3523,7 @@ static int XAxisCmd(int second, Ns_Chart * chart, int objc, Tcl_Obj * CONST objv
                 Tcl_WrongNumArgs(interp, 4, objv, "font fontsize fontcolor fontangle");
                 return TCL_ERROR;
             }
-            xaxis->setLabelStyle(font, fontsize, fontcolor, fontangle);
+            xaxis->setLabelStyle(chartFont(font), fontsize, fontcolor, fontangle);
             break;
         }
     }
@@ -763,7 +3638,7 @@ static int YAxisCmd(int second, Ns_Chart * chart, int objc, Tcl_Obj * CONST objv
                                  "value linecolor linewidth text ?align? ?font? ?fontsize? ?fontcolor? ?fontangle? ?ontop? ?tickcolor?");
                 return TCL_ERROR;
             }
-            Mark *mark = yaxis->addMark(value, linecolor, text, font, fontsize);
+            Mark *mark = yaxis->addMark(value, linecolor, text, chartFont(font), fontsize);
             mark->setLineWidth(linewidth);
             mark->setMarkColor(linecolor, fontcolor, tickcolor ? tickcolor : linecolor);
             mark->setAlignment(chartAlignment(align, TopCenter));
@@ -785,7 +3660,7 @@ static int YAxisCmd(int second, Ns_Chart * chart, int objc, Tcl_Obj * CONST objv
                 Tcl_WrongNumArgs(interp, 4, objv, "font fontsize fontcolor fontangle");
                 return TCL_ERROR;
             }
-            yaxis->setLabelStyle(font, fontsize, fontcolor, fontangle);
+            yaxis->setLabelStyle(chartFont(font), fontsize, fontcolor, fontangle);
             break;
         }
 
@@ -890,6 +3765,8 @@ static int LayerCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Inte
 {
     int cmd, layer, datasetID;
     DataSet *dataset;
+    ChartDataOptions opts;
+    Tcl_Obj *args[32];
 
     enum commands {
         cmdCreate, cmdSetLineWidth,
@@ -922,36 +3799,48 @@ static int LayerCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Inte
     if (Tcl_GetIndexFromObj(interp, objv[3], sCmd, "command", TCL_EXACT, (int *) &cmd) != TCL_OK)
         return TCL_ERROR;
 
+    if (cmd == cmdCreate || cmd == cmdDataSet) {
+        /* Options and arguments of both commands fit many times over */
+        if (objc > (int) (sizeof(args) / sizeof(args[0]))) {
+            Tcl_AppendResult(interp, "too many arguments", 0);
+            return TCL_ERROR;
+        }
+        if ((objc = chartDataOptions(interp, objc, objv, args, &opts)) < 0)
+            return TCL_ERROR;
+        objv = args;
+    } else
+        memset(&opts, 0, sizeof(opts));
+
     if (cmd > cmdCreate) {
-        if (Tcl_GetIntFromObj(interp, objv[4], &layer) != TCL_OK)
+        if (objc < 5 || Tcl_GetIntFromObj(interp, objv[4], &layer) != TCL_OK)
             return TCL_ERROR;
-        if (layer < 0 || layer >= MAX_LAYERS || !chart->layers[layer].layer) {
+        if (layer < 0 || layer >= chart->nlayers || !chart->layers[layer].layer) {
             Tcl_AppendResult(interp, "wrong layer #", 0);
             return TCL_ERROR;
         }
-    } else {
-        for (layer = 0; layer < MAX_LAYERS && chart->layers[layer].layer; layer++);
-        if (layer == MAX_LAYERS) {
-            Tcl_AppendResult(interp, "no more available layer slots left", 0);
-            return TCL_ERROR;
-        }
-    }
+    } else
+        layer = chartNextLayer(chart);
 
     switch (cmd) {
     case cmdCreate:{
-            int argc;
-            Tcl_Obj **argv;
+            int argc, source;
             char *name = 0;
             int color = -1;
+            double *data, *x;
 
-            if (objc < 6 || Tcl_ListObjGetElements(interp, objv[5], &argc, &argv) != TCL_OK) {
-                Tcl_WrongNumArgs(interp, 4, objv, "type data ?name? ?color?");
+            if (objc < 6) {
+                Tcl_WrongNumArgs(interp, 4, objv, "?-binary float64|float32? ?-downsample lttb|minmax|avg? ?-target N? type data ?name? ?color?");
+                return TCL_ERROR;
+            }
+            if (!(data = chartDoubles(interp, objv[5], &opts, &argc)))
+                return TCL_ERROR;
+            source = argc;
+            argc = chartDownsample(chart, &opts, data, argc, &x);
+            if (chartLimitPoints(chart, argc, interp) != TCL_OK) {
+                ns_free(data);
+                ns_free(x);
                 return TCL_ERROR;
             }
-
-            double *data = (double *) ns_malloc(argc * sizeof(double));
-            for (int i = 0; i < argc; i++)
-                data[i] = atof(Tcl_GetStringFromObj(argv[i], 0));
 
             char *type = Tcl_GetStringFromObj(objv[4], 0);
 
@@ -960,6 +3849,7 @@ static int LayerCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Inte
                     (objc > 7 && chartColor(interp, objv[7], &color) != TCL_OK)) {
                     Tcl_WrongNumArgs(interp, 4, objv, "type data ?name? ?color?");
                     ns_free(data);
+                    ns_free(x);
                     return TCL_ERROR;
                 }
                 chart->layers[layer].line = chart->xy->addLineLayer(argc, data, color, name);
@@ -985,6 +3875,7 @@ static int LayerCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Inte
                         (colorc > 1 && colorc != argc)) {
                         Tcl_WrongNumArgs(interp, 4, objv, "type data ?names? ?colors?, invalid number of items in colors");
                         ns_free(data);
+                        ns_free(x);
                         return TCL_ERROR;
                     }
                     if (colorc == 1)
@@ -1013,6 +3904,8 @@ static int LayerCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Inte
                 if ((objc > 6 && !(name = Tcl_GetStringFromObj(objv[6], 0))) ||
                     (objc > 7 && chartColor(interp, objv[7], &color) != TCL_OK)) {
                     Tcl_WrongNumArgs(interp, 4, objv, "type data ?name? ?color?");
+                    ns_free(data);
+                    ns_free(x);
                     return TCL_ERROR;
                 }
                 chart->layers[layer].layer = chart->xy->addAreaLayer(argc, data, color, name);
@@ -1021,6 +3914,8 @@ static int LayerCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Inte
                 if ((objc > 6 && !(name = Tcl_GetStringFromObj(objv[6], 0))) ||
                     (objc > 7 && chartColor(interp, objv[7], &color) != TCL_OK)) {
                     Tcl_WrongNumArgs(interp, 4, objv, "type data ?name? ?color?");
+                    ns_free(data);
+                    ns_free(x);
                     return TCL_ERROR;
                 }
                 chart->layers[layer].trend = chart->xy->addTrendLayer(DoubleArray(data, argc), color, name);
@@ -1030,9 +3925,21 @@ static int LayerCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Inte
                 Tcl_AppendResult(interp, "wrong layer type: should be one of line bar scatter area trend hloc candlestick",
                                  0);
                 ns_free(data);
+                ns_free(x);
                 return TCL_ERROR;
             }
             ns_free(data);
+            /* Datasets added later are reduced the same way */
+            chart->layers[layer].downsample = opts.downsample;
+            chart->layers[layer].target = opts.target;
+            if (x) {
+                chart->layers[layer].layer->setXData(DoubleArray(x, argc));
+                chart->layers[layer].x = x;
+                chart->layers[layer].xcount = argc;
+                chart->layers[layer].xsource = source;
+            }
+            chartAccount(chart, CHART_LAYER_SIZE + (long) argc * CHART_POINT_SIZE);
+            chart->nlayers++;
             Tcl_SetObjResult(interp, Tcl_NewIntObj(layer));
             break;
         }
@@ -1130,19 +4037,24 @@ static int LayerCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Inte
             char *name = 0;
             int color = -1;
             int argc;
-            Tcl_Obj **argv;
+            double *data = 0;
 
-            if (Tcl_ListObjGetElements(interp, objv[5], &argc, &argv) != TCL_OK ||
+            if (objc < 6 ||
                 (objc > 6 && !(name = Tcl_GetStringFromObj(objv[6], 0))) ||
                 (objc > 7 && chartColor(interp, objv[7], &color) != TCL_OK)) {
-                Tcl_WrongNumArgs(interp, 4, objv, "#layer data ?name? ?color?");
+                Tcl_WrongNumArgs(interp, 4, objv, "?-binary float64|float32? ?-downsample lttb|minmax|avg? ?-target N? #layer data ?name? ?color?");
+                return TCL_ERROR;
+            }
+            if (!(data = chartDoubles(interp, objv[5], &opts, &argc)))
+                return TCL_ERROR;
+            if ((argc = chartLayerDownsample(chart, &chart->layers[layer], &opts, data, argc, interp)) < 0 ||
+                chartLimitPoints(chart, argc, interp) != TCL_OK) {
+                ns_free(data);
                 return TCL_ERROR;
             }
-            double *data = (double *) ns_malloc(argc * sizeof(double));
-            for (int i = 0; i < argc; i++)
-                data[i] = atof(Tcl_GetStringFromObj(argv[i], 0));
 
             chart->layers[layer].layer->addDataSet(argc, data, color, name);
+            chartAccount(chart, (long) argc * CHART_POINT_SIZE);
             ns_free(data);
             break;
         }
@@ -1168,7 +4080,7 @@ static int LayerCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Inte
                 if (!strcasecmp(symbolName, chartSymbolTypes[symbol]))
                     break;
             if (!chartSymbolTypes[symbol])
-                dataset->setDataSymbol(symbolName);
+                dataset->setDataSymbol(chartAsset(chart, symbolName));
             else
                 dataset->setDataSymbol((SymbolType) symbol, size, fillcolor, edgecolor);
             break;
@@ -1207,7 +4119,7 @@ static int LayerCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Inte
                 Tcl_WrongNumArgs(interp, 4, objv, "font ?fontsize? ?fontcolor? ?fontangle?");
                 return TCL_ERROR;
             }
-            chart->layers[layer].layer->setDataLabelStyle(font, fontsize, fontcolor, fontangle);
+            chart->layers[layer].layer->setDataLabelStyle(chartFont(font), fontsize, fontcolor, fontangle);
             break;
         }
 
@@ -1224,7 +4136,7 @@ static int LayerCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Inte
                 Tcl_WrongNumArgs(interp, 4, objv, "font ?fontsize? ?fontcolor? ?fontangle?");
                 return TCL_ERROR;
             }
-            chart->layers[layer].layer->setAggregateLabelStyle(font, fontsize, fontcolor, fontangle);
+            chart->layers[layer].layer->setAggregateLabelStyle(chartFont(font), fontsize, fontcolor, fontangle);
             break;
         }
     }
@@ -1262,156 +4174,839 @@ static int patternColor(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_
         Tcl_WrongNumArgs(interp, 2, objv, "#chart pattern width height ?startx? ?starty?");
         return TCL_ERROR;
     }
-    // Check if it is filename
-    if (argc == 1 && Tcl_GetIntFromObj(interp, argv[0], &i) != TCL_OK) {
-        Tcl_SetObjResult(interp,
-                         Tcl_NewIntObj(chart->chart->patternColor(Tcl_GetStringFromObj(argv[0], 0), startx, starty)));
-        return TCL_OK;
+    // Check if it is filename
+    if (argc == 1 && Tcl_GetIntFromObj(interp, argv[0], &i) != TCL_OK) {
+        Tcl_SetObjResult(interp,
+                         Tcl_NewIntObj(chart->chart->patternColor(chartAsset(chart, Tcl_GetStringFromObj(argv[0], 0)), startx, starty)));
+        return TCL_OK;
+    }
+    if (width * height != argc) {
+        Tcl_AppendResult(interp, "wrong width/height for the pattern bitmap", 0);
+        return TCL_ERROR;
+    }
+    int *pattern = (int *) ns_malloc(argc * sizeof(int));
+    for (i = 0; i < argc; i++)
+        Tcl_GetIntFromObj(interp, argv[i], &pattern[i]);
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(chart->chart->patternColor(pattern, width, height, startx, starty)));
+    ns_free(pattern);
+    return TCL_OK;
+}
+
+static int gradientColor(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
+{
+    int *array, argc;
+    char *name = 0;
+    Tcl_Obj **argv;
+    double angle = 90;
+    double scale = 1;
+    int startx = 0;
+    int starty = 0;
+
+    if (objc < 4 ||
+        Tcl_ListObjGetElements(interp, objv[3], &argc, &argv) != TCL_OK ||
+        (objc > 4 && Tcl_GetDoubleFromObj(interp, objv[4], &angle) != TCL_OK) ||
+        (objc > 5 && Tcl_GetDoubleFromObj(interp, objv[5], &scale) != TCL_OK) ||
+        (objc > 6 && Tcl_GetIntFromObj(interp, objv[6], &startx) != TCL_OK) ||
+        (objc > 7 && Tcl_GetIntFromObj(interp, objv[7], &starty) != TCL_OK)) {
+        Tcl_WrongNumArgs(interp, 2, objv, "#chart array ?angle? ?scale? ?startx? ?starty?");
+        return TCL_ERROR;
+    }
+    // Check if it is name
+    if (argc == 1 && (name = Tcl_GetStringFromObj(argv[0], 0)) &&
+        ((!strcasecmp("goldGradient", name) && (array = (int *) goldGradient)) ||
+         (!strcasecmp("silverGradient", name) && (array = (int *) silverGradient)) ||
+         (!strcasecmp("redMetalGradient", name) && (array = (int *) redMetalGradient)) ||
+         (!strcasecmp("blueMetalGradient", name) && (array = (int *) blueMetalGradient)) ||
+         (!strcasecmp("greenMetalGradient", name) && (array = (int *) greenMetalGradient)))) {
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(chart->chart->gradientColor(array, angle, scale, startx, starty)));
+        return TCL_OK;
+    } else {
+        array = (int *) ns_malloc(argc * sizeof(int));
+        for (int i = 0; i < argc; i++)
+            Tcl_GetIntFromObj(interp, argv[i], &array[i]);
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(chart->chart->gradientColor(array, angle, scale, startx, starty)));
+        ns_free(array);
+    }
+    return TCL_OK;
+}
+
+static int addText(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
+{
+    int x, y;
+    const char *text;
+    const char *font = 0;
+    const char *align = 0;
+    int fontsize = 8;
+    int fontcolor = TextColor;
+    int vertical = 0;
+    double angle = 0;
+
+    if (objc < 6 ||
+        Tcl_GetIntFromObj(interp, objv[3], &x) != TCL_OK ||
+        Tcl_GetIntFromObj(interp, objv[4], &y) != TCL_OK ||
+        !(text = Tcl_GetStringFromObj(objv[5], 0)) ||
+        (objc > 6 && !(font = Tcl_GetStringFromObj(objv[6], 0))) ||
+        (objc > 7 && Tcl_GetIntFromObj(interp, objv[7], &fontsize) != TCL_OK) ||
+        (objc > 8 && chartColor(interp, objv[8], &fontcolor) != TCL_OK) ||
+        (objc > 9 && !(align = Tcl_GetStringFromObj(objv[9], 0))) ||
+        (objc > 10 && Tcl_GetDoubleFromObj(interp, objv[10], &angle) != TCL_OK) ||
+        (objc > 11 && Tcl_GetIntFromObj(interp, objv[11], &vertical) != TCL_OK)) {
+        Tcl_WrongNumArgs(interp, 2, objv, "#chart x y text ?font? ?fontsize? ?fontcolor? ?alignment? ?angle? ?vertical?");
+        return TCL_ERROR;
+    }
+    chart->chart->addText(x, y, text, chartFont(font), fontsize, fontcolor, chartAlignment(align, TopLeft), angle, vertical);
+    return TCL_OK;
+}
+
+static int PieCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
+{
+    int cmd;
+    enum commands {
+        cmdSetData, cmdSet3D,
+        cmdSetPieSize
+    };
+
+    static const char *sCmd[] = {
+        "setdata", "set3d",
+        "setpiesize",
+        0
+    };
+    if (chart->type != PieChartType) {
+        Tcl_AppendResult(interp, "wrong chart type", 0);
+        return TCL_ERROR;
+    }
+    if (objc < 4) {
+        Tcl_WrongNumArgs(interp, 2, objv, "#chart cmd");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[3], sCmd, "command", TCL_EXACT, (int *) &cmd) != TCL_OK)
+        return TCL_ERROR;
+
+    switch (cmd) {
+    case cmdSetData:{
+            char **labels = 0;
+            int argc, labelc = 0;
+            Tcl_Obj **argv, **labelv;
+
+            if (objc < 5 ||
+                Tcl_ListObjGetElements(interp, objv[4], &argc, &argv) != TCL_OK ||
+                (objc > 5 && Tcl_ListObjGetElements(interp, objv[5], &labelc, &labelv) != TCL_OK)) {
+                Tcl_WrongNumArgs(interp, 4, objv, "data ?labels?");
+                return TCL_ERROR;
+            }
+            if (chartLimitPoints(chart, argc, interp) != TCL_OK)
+                return TCL_ERROR;
+            double *data = chartDoubles(interp, objv[4], 0, &argc);
+
+            if (labelc > 0) {
+                labels = (char **) ns_malloc(labelc * sizeof(char *));
+                for (int i = 0; i < labelc; i++)
+                    labels[i] = Tcl_GetStringFromObj(labelv[i], 0);
+            }
+            chart->pie->setData(argc, data, labels);
+            chartAccount(chart, (long) argc * CHART_POINT_SIZE);
+            ns_free(data);
+            ns_free(labels);
+        }
+
+    case cmdSet3D:
+        chart->pie->set3D();
+        break;
+
+    case cmdSetPieSize:{
+            int x, y, r;
+
+            if (objc < 7 ||
+                Tcl_GetIntFromObj(interp, objv[4], &x) != TCL_OK ||
+                Tcl_GetIntFromObj(interp, objv[5], &y) != TCL_OK || Tcl_GetIntFromObj(interp, objv[6], &r) != TCL_OK) {
+                Tcl_WrongNumArgs(interp, 4, objv, "x y r");
+                return TCL_ERROR;
+            }
+            chart->pie->setPieSize(x, y, r);
+        }
+    }
+    return TCL_OK;
+}
+
+static int xAxisCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
+{
+    return XAxisCmd(0, chart, objc, objv, interp);
+}
+
+static int xAxis2Cmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
+{
+    return XAxisCmd(1, chart, objc, objv, interp);
+}
+
+static int yAxisCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
+{
+    return YAxisCmd(0, chart, objc, objv, interp);
+}
+
+static int yAxis2Cmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
+{
+    return YAxisCmd(1, chart, objc, objv, interp);
+}
+
+/*
+ * Chart spec keys for render command, value of the key is the argument list
+ * of the corresponding ns_chartdir subcommand or, for multi keys, list of
+ * such argument lists
+ */
+static const struct {
+    const char *key;
+    const char *cmd;
+    ChartProc *proc;
+    int multi;
+} chartSpecKeys[] = {
+    { "background", "setbackground", setBackground, 0 },
+    { "plotarea", "setplotarea", setPlotArea, 0 },
+    { "legend", "addlegend", addLegend, 0 },
+    { "bgimage", "setbgimage", setBgImage, 0 },
+    { "wallpaper", "setwallpaper", setWallpaper, 0 },
+    { "colors", "setcolors", setColors, 0 },
+    { "titles", "addtitle", addTitle, 1 },
+    { "texts", "addtext", addText, 1 },
+    { "xaxis", "xaxis", xAxisCmd, 1 },
+    { "xaxis2", "xaxis2", xAxis2Cmd, 1 },
+    { "yaxis", "yaxis", yAxisCmd, 1 },
+    { "yaxis2", "yaxis2", yAxis2Cmd, 1 },
+    { "layers", "layer", LayerCmd, 1 },
+    { "pie", "pie", PieCmd, 1 },
+    { 0, 0, 0, 0 }
+};
+
+/*
+ * Chart commands recorded by template scripts
+ */
+static const struct {
+    const char *cmd;
+    ChartProc *proc;
+} chartCmds[] = {
+    { "setbackground", setBackground },
+    { "setplotarea", setPlotArea },
+    { "addlegend", addLegend },
+    { "addtitle", addTitle },
+    { "setsize", setSize },
+    { "setbgimage", setBgImage },
+    { "setwallpaper", setWallpaper },
+    { "yaxis", yAxisCmd },
+    { "xaxis", xAxisCmd },
+    { "yaxis2", yAxis2Cmd },
+    { "xaxis2", xAxis2Cmd },
+    { "layer", LayerCmd },
+    { "dashlinecolor", dashLineColor },
+    { "patterncolor", patternColor },
+    { "gradientcolor", gradientColor },
+    { "addtext", addText },
+    { "setcolors", setColors },
+    { "pie", PieCmd },
+    { 0, 0 }
+};
+
+// Calls chart proc with given argument list as if it was passed to ns_chartdir
+static int chartSpecCall(Ns_Chart * chart, ChartProc * proc, Tcl_Obj * cmd, Tcl_Obj * args, Tcl_Interp * interp)
+{
+    int argc, result;
+    Tcl_Obj **argv, *buf[16], **objv = buf;
+
+    if (Tcl_ListObjGetElements(interp, args, &argc, &argv) != TCL_OK)
+        return TCL_ERROR;
+    if (argc + 3 > 16)
+        objv = (Tcl_Obj **) ns_malloc((argc + 3) * sizeof(Tcl_Obj *));
+    objv[0] = objv[1] = objv[2] = cmd;
+    memcpy(objv + 3, argv, argc * sizeof(Tcl_Obj *));
+    result = proc(chart, argc + 3, objv, interp);
+    if (objv != buf)
+        ns_free(objv);
+    return result;
+}
+
+static int chartSpecGet(Tcl_Obj * spec, const char *name, Tcl_Obj ** value, Tcl_Interp * interp)
+{
+    int result;
+    Tcl_Obj *key = Tcl_NewStringObj(name, -1);
+
+    Tcl_IncrRefCount(key);
+    result = Tcl_DictObjGet(interp, spec, key, value);
+    Tcl_DecrRefCount(key);
+    return result;
+}
+
+/*
+ * Template registry, templates are refcounted so redefining or deleting one
+ * does not affect charts being created from it
+ */
+static ChartTemplate *getTemplate(const char *name)
+{
+    Tcl_HashEntry *hPtr;
+    ChartTemplate *tmpl = 0;
+
+    Ns_MutexLock(&templateMutex);
+    if ((hPtr = Tcl_FindHashEntry(&templateTable, name))) {
+        tmpl = (ChartTemplate *) Tcl_GetHashValue(hPtr);
+        tmpl->refcount++;
+    }
+    Ns_MutexUnlock(&templateMutex);
+    return tmpl;
+}
+
+static void releaseTemplate(ChartTemplate * tmpl)
+{
+    int refcount;
+
+    Ns_MutexLock(&templateMutex);
+    refcount = --tmpl->refcount;
+    Ns_MutexUnlock(&templateMutex);
+    if (refcount > 0)
+        return;
+    for (int i = 0; i < tmpl->count; i++) {
+        ns_free(tmpl->cmds[i].args);
+    }
+    ns_free(tmpl->cmds);
+    ns_free(tmpl->create);
+    ns_free(tmpl);
+}
+
+static void templateAppend(ChartTemplate * tmpl, const char *name, ChartProc * proc, Tcl_Obj * args)
+{
+    tmpl->cmds = (ChartTemplateCmd *) ns_realloc(tmpl->cmds, (tmpl->count + 1) * sizeof(ChartTemplateCmd));
+    tmpl->cmds[tmpl->count].name = name;
+    tmpl->cmds[tmpl->count].proc = proc;
+    tmpl->cmds[tmpl->count].args = ns_strdup(Tcl_GetString(args));
+    tmpl->count++;
+}
+
+// Records successful chart command of the template script
+static void templateRecord(ChartTemplate * tmpl, int objc, Tcl_Obj * CONST objv[])
+{
+    int i;
+    char *name = Tcl_GetStringFromObj(objv[1], 0);
+
+    for (i = 0; chartCmds[i].cmd && strcmp(chartCmds[i].cmd, name); i++);
+    if (chartCmds[i].cmd) {
+        Tcl_Obj *args = Tcl_NewListObj(objc - 3, objv + 3);
+        templateAppend(tmpl, chartCmds[i].cmd, chartCmds[i].proc, args);
+        Tcl_DecrRefCount(args);
+    }
+}
+
+/*
+ * Applies template commands to the new chart by calling command procs
+ * directly, the spec hash is updated the same way as by ns_chartdir
+ */
+static int applyTemplate(Ns_Chart * chart, ChartTemplate * tmpl, Tcl_Interp * interp)
+{
+    int i, argc, result = TCL_OK;
+    Tcl_Obj *name, *args, **argv;
+
+    for (i = 0; result == TCL_OK && i < tmpl->count; i++) {
+        name = Tcl_NewStringObj(tmpl->cmds[i].name, -1);
+        args = Tcl_NewStringObj(tmpl->cmds[i].args, -1);
+        Tcl_IncrRefCount(name);
+        Tcl_IncrRefCount(args);
+        if ((result = Tcl_ListObjGetElements(interp, args, &argc, &argv)) == TCL_OK) {
+            chartHashObjs(chart, 1, &name);
+            chartHashObjs(chart, argc, argv);
+            result = chartSpecCall(chart, tmpl->cmds[i].proc, name, args, interp);
+        }
+        Tcl_DecrRefCount(name);
+        Tcl_DecrRefCount(args);
+    }
+    return result;
+}
+
+/*
+ * Converts chart spec dict into the template, same keys as for render
+ */
+static int templateSpec(ChartTemplate * tmpl, Tcl_Obj * spec, Tcl_Interp * interp)
+{
+    int i, done, argc, result = TCL_OK;
+    const char *type = "xy";
+    Tcl_Obj *key, *value, *list, **argv;
+    Tcl_DictSearch search;
+
+    if (chartSpecGet(spec, "type", &value, interp) != TCL_OK)
+        return TCL_ERROR;
+    if (value)
+        type = Tcl_GetStringFromObj(value, 0);
+    if (chartSpecGet(spec, "size", &value, interp) != TCL_OK)
+        return TCL_ERROR;
+    /* Default size is a temporary object, held while appended */
+    value = value ? value : Tcl_NewStringObj("500 300", -1);
+    Tcl_IncrRefCount(value);
+    list = Tcl_NewStringObj(type, -1);
+    Tcl_IncrRefCount(list);
+    result = Tcl_ListObjAppendList(interp, list, value);
+    Tcl_DecrRefCount(value);
+    if (result != TCL_OK) {
+        Tcl_DecrRefCount(list);
+        return TCL_ERROR;
+    }
+    tmpl->create = ns_strdup(Tcl_GetString(list));
+    Tcl_DecrRefCount(list);
+
+    if (Tcl_DictObjFirst(interp, spec, &search, &key, &value, &done) != TCL_OK)
+        return TCL_ERROR;
+    for (; result == TCL_OK && !done; Tcl_DictObjNext(&search, &key, &value, &done)) {
+        char *name = Tcl_GetStringFromObj(key, 0);
+
+        if (!strcmp(name, "type") || !strcmp(name, "size"))
+            continue;
+        for (i = 0; chartSpecKeys[i].key && strcmp(chartSpecKeys[i].key, name); i++);
+        if (!chartSpecKeys[i].key) {
+            Tcl_AppendResult(interp, "unknown chart spec key \"", name, "\"", 0);
+            result = TCL_ERROR;
+            break;
+        }
+        if (!chartSpecKeys[i].multi) {
+            templateAppend(tmpl, chartSpecKeys[i].cmd, chartSpecKeys[i].proc, value);
+            continue;
+        }
+        if ((result = Tcl_ListObjGetElements(interp, value, &argc, &argv)) != TCL_OK)
+            break;
+        for (int j = 0; j < argc; j++)
+            templateAppend(tmpl, chartSpecKeys[i].cmd, chartSpecKeys[i].proc, argv[j]);
+    }
+    Tcl_DictObjDone(&search);
+    return result;
+}
+
+/*
+ * ns_chartdir template define name script-or-spec
+ * ns_chartdir template delete name
+ * ns_chartdir template names
+ *
+ * The script is evaluated once, the first chart it creates is recorded
+ * and destroyed afterwards
+ */
+static int TemplateCmd(ChartInterp * data, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
+{
+    int i, isNew, result, cmd;
+    char *name;
+    Ns_Chart *chart;
+    ChartTemplate *tmpl, *old;
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+
+    enum commands { cmdDefine, cmdDelete, cmdNames };
+    static const char *sCmd[] = { "define", "delete", "names", 0 };
+
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 2, objv, "define|delete|names ?name? ?script-or-spec?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[2], sCmd, "command", TCL_EXACT, &cmd) != TCL_OK)
+        return TCL_ERROR;
+
+    switch (cmd) {
+    case cmdNames:{
+            Tcl_Obj *list = Tcl_NewListObj(0, 0);
+
+            Ns_MutexLock(&templateMutex);
+            for (hPtr = Tcl_FirstHashEntry(&templateTable, &search); hPtr; hPtr = Tcl_NextHashEntry(&search))
+                Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj((char *) Tcl_GetHashKey(&templateTable, hPtr), -1));
+            Ns_MutexUnlock(&templateMutex);
+            Tcl_SetObjResult(interp, list);
+            return TCL_OK;
+        }
+
+    case cmdDelete:
+        if (objc < 4) {
+            Tcl_WrongNumArgs(interp, 3, objv, "name");
+            return TCL_ERROR;
+        }
+        tmpl = 0;
+        Ns_MutexLock(&templateMutex);
+        if ((hPtr = Tcl_FindHashEntry(&templateTable, Tcl_GetStringFromObj(objv[3], 0)))) {
+            tmpl = (ChartTemplate *) Tcl_GetHashValue(hPtr);
+            Tcl_DeleteHashEntry(hPtr);
+        }
+        Ns_MutexUnlock(&templateMutex);
+        if (tmpl)
+            releaseTemplate(tmpl);
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(tmpl != 0));
+        return TCL_OK;
+    }
+
+    if (objc < 5) {
+        Tcl_WrongNumArgs(interp, 3, objv, "name script-or-spec");
+        return TCL_ERROR;
+    }
+    if (data->recording) {
+        Tcl_AppendResult(interp, "template definitions cannot be nested", 0);
+        return TCL_ERROR;
     }
-    if (width * height != argc) {
-        Tcl_AppendResult(interp, "wrong width/height for the pattern bitmap", 0);
+    name = Tcl_GetStringFromObj(objv[3], 0);
+    tmpl = (ChartTemplate *) ns_calloc(1, sizeof(ChartTemplate));
+    tmpl->refcount = 1;
+
+    /* Spec dict starts with one of the spec keys, otherwise it is a script */
+    result = Tcl_ListObjLength(0, objv[4], &i) == TCL_OK && i > 1 && !(i % 2);
+    if (result) {
+        Tcl_Obj *first;
+        char *key;
+
+        Tcl_ListObjIndex(0, objv[4], 0, &first);
+        key = Tcl_GetStringFromObj(first, 0);
+        for (i = 0; chartSpecKeys[i].key && strcmp(chartSpecKeys[i].key, key); i++);
+        result = chartSpecKeys[i].key || !strcmp(key, "type") || !strcmp(key, "size");
+    }
+    if (result)
+        result = templateSpec(tmpl, objv[4], interp);
+    else {
+        data->recording = tmpl;
+        data->recordChart = 0;
+        result = Tcl_EvalObjEx(interp, objv[4], 0);
+        chart = data->recordChart;
+        data->recording = 0;
+        data->recordChart = 0;
+        if (chart) {
+            Ns_MutexLock(&chart->lock);
+            chart->recording = 0;
+            Ns_MutexUnlock(&chart->lock);
+            freeChart(chart);
+            releaseChart(chart);
+        } else if (result == TCL_OK) {
+            Tcl_AppendResult(interp, "template script did not create a chart", 0);
+            result = TCL_ERROR;
+        }
+    }
+    if (result != TCL_OK) {
+        releaseTemplate(tmpl);
         return TCL_ERROR;
     }
-    int *pattern = (int *) ns_malloc(argc * sizeof(int));
-    for (i = 0; i < argc; i++)
-        Tcl_GetIntFromObj(interp, argv[i], &pattern[i]);
-    Tcl_SetObjResult(interp, Tcl_NewIntObj(chart->chart->patternColor(pattern, width, height, startx, starty)));
-    ns_free(pattern);
+
+    /* Charts being created from the previous definition keep it until done */
+    Ns_MutexLock(&templateMutex);
+    hPtr = Tcl_CreateHashEntry(&templateTable, name, &isNew);
+    old = isNew ? 0 : (ChartTemplate *) Tcl_GetHashValue(hPtr);
+    Tcl_SetHashValue(hPtr, tmpl);
+    Ns_MutexUnlock(&templateMutex);
+    if (old)
+        releaseTemplate(old);
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(tmpl->count));
     return TCL_OK;
 }
 
-static int gradientColor(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
+/*
+ * Builds and renders chart from the spec dict without registering it:
+ *
+ *  type xy|pie size {width height ?bgcolor? ?edgecolor? ?border?}
+ *  background {...} plotarea {...} legend {...} titles {{...} ...} ...
+ */
+static int renderChart(Tcl_Obj * spec, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
 {
-    int *array, argc;
-    char *name = 0;
-    Tcl_Obj **argv;
-    double angle = 90;
-    double scale = 1;
-    int startx = 0;
-    int starty = 0;
+    int i, done, argc, result = TCL_OK;
+    int width = 500, height = 300, bgcolor = 0xFFFFFF, edgecolor = -1, border = 0;
+    int ret = 0, blob = 0;
+    const char *type = "xy";
+    Tcl_Obj *key, *value, **argv;
+    Tcl_DictSearch search;
+    Ns_Conn *conn = 0;
+    Ns_Chart chart;
+    ChartImage *image;
+    ChartFormat fmt = { 0, 0 };
+    MemBlock mem;
+
+    for (i = 0; i < objc; i++) {
+        char *opt = Tcl_GetStringFromObj(objv[i], 0);
+        int rc = chartFormatOption(interp, objc, objv, &i, &fmt);
+
+        if (rc < 0)
+            return TCL_ERROR;
+        if (rc > 0)
+            continue;
+        if (!strcmp(opt, "-return"))
+            ret = 1;
+        else if (!strcmp(opt, "-blob"))
+            blob = 1;
+        else {
+            Tcl_AppendResult(interp, "wrong option \"", opt, "\": should be -blob, -format, -quality or -return", 0);
+            return TCL_ERROR;
+        }
+    }
+    if (ret && !(conn = Ns_TclGetConn(interp))) {
+        Tcl_AppendResult(interp, "no connection", NULL);
+        return TCL_ERROR;
+    }
 
-    if (objc < 4 ||
-        Tcl_ListObjGetElements(interp, objv[3], &argc, &argv) != TCL_OK ||
-        (objc > 4 && Tcl_GetDoubleFromObj(interp, objv[4], &angle) != TCL_OK) ||
-        (objc > 5 && Tcl_GetDoubleFromObj(interp, objv[5], &scale) != TCL_OK) ||
-        (objc > 6 && Tcl_GetIntFromObj(interp, objv[6], &startx) != TCL_OK) ||
-        (objc > 7 && Tcl_GetIntFromObj(interp, objv[7], &starty) != TCL_OK)) {
-        Tcl_WrongNumArgs(interp, 2, objv, "#chart array ?angle? ?scale? ?startx? ?starty?");
+    memset(&chart, 0, sizeof(chart));
+    chartInitLayers(&chart);
+    chart.hash = CHART_HASH_BASIS;
+    chartHashObjs(&chart, 1, &spec);
+
+    /* Chart is built before the cache lookup, image files used by the spec
+     * add their mtime and size to the hash while it is built */
+    if (chartSpecGet(spec, "type", &value, interp) != TCL_OK)
+        return TCL_ERROR;
+    if (value)
+        type = Tcl_GetStringFromObj(value, 0);
+    if (chartSpecGet(spec, "size", &value, interp) != TCL_OK)
+        return TCL_ERROR;
+    if (value &&
+        (Tcl_ListObjGetElements(interp, value, &argc, &argv) != TCL_OK ||
+         argc < 2 ||
+         Tcl_GetIntFromObj(interp, argv[0], &width) != TCL_OK ||
+         Tcl_GetIntFromObj(interp, argv[1], &height) != TCL_OK ||
+         (argc > 2 && chartColor(interp, argv[2], &bgcolor) != TCL_OK) ||
+         (argc > 3 && chartColor(interp, argv[3], &edgecolor) != TCL_OK) ||
+         (argc > 4 && Tcl_GetIntFromObj(interp, argv[4], &border) != TCL_OK))) {
+        Tcl_AppendResult(interp, ": size should be width height ?bgcolor? ?edgecolor? ?border?", 0);
         return TCL_ERROR;
     }
-    // Check if it is name
-    if (argc == 1 && (name = Tcl_GetStringFromObj(argv[0], 0)) &&
-        ((!strcasecmp("goldGradient", name) && (array = (int *) goldGradient)) ||
-         (!strcasecmp("silverGradient", name) && (array = (int *) silverGradient)) ||
-         (!strcasecmp("redMetalGradient", name) && (array = (int *) redMetalGradient)) ||
-         (!strcasecmp("blueMetalGradient", name) && (array = (int *) blueMetalGradient)) ||
-         (!strcasecmp("greenMetalGradient", name) && (array = (int *) greenMetalGradient)))) {
-        Tcl_SetObjResult(interp, Tcl_NewIntObj(chart->chart->gradientColor(array, angle, scale, startx, starty)));
-        return TCL_OK;
+    if (chartLimitSize(interp, width, height) != TCL_OK)
+        return TCL_ERROR;
+    if (!strcasecmp(type, "pie")) {
+        chart.pie = PieChart::create(width, height);
+        chart.chart = chart.pie;
+        chart.type = PieChartType;
     } else {
-        array = (int *) ns_malloc(argc * sizeof(int));
-        for (int i = 0; i < argc; i++)
-            Tcl_GetIntFromObj(interp, argv[i], &array[i]);
-        Tcl_SetObjResult(interp, Tcl_NewIntObj(chart->chart->gradientColor(array, angle, scale, startx, starty)));
-        ns_free(array);
+        chart.xy = XYChart::create(width, height);
+        chart.chart = chart.xy;
+        chart.type = XYChartType;
     }
-    return TCL_OK;
-}
+    chart.chart->setBackground(bgcolor, edgecolor, border);
+    chartResize(&chart, width, height);
 
-static int addText(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
-{
-    int x, y;
-    const char *text;
-    const char *font = 0;
-    const char *align = 0;
-    int fontsize = 8;
-    int fontcolor = TextColor;
-    int vertical = 0;
-    double angle = 0;
+    if (Tcl_DictObjFirst(interp, spec, &search, &key, &value, &done) != TCL_OK) {
+        chart.chart->destroy();
+        chartClear(&chart);
+        return TCL_ERROR;
+    }
+    for (; result == TCL_OK && !done; Tcl_DictObjNext(&search, &key, &value, &done)) {
+        char *name = Tcl_GetStringFromObj(key, 0);
 
-    if (objc < 6 ||
-        Tcl_GetIntFromObj(interp, objv[3], &x) != TCL_OK ||
-        Tcl_GetIntFromObj(interp, objv[4], &y) != TCL_OK ||
-        !(text = Tcl_GetStringFromObj(objv[5], 0)) ||
-        (objc > 6 && !(font = Tcl_GetStringFromObj(objv[6], 0))) ||
-        (objc > 7 && Tcl_GetIntFromObj(interp, objv[7], &fontsize) != TCL_OK) ||
-        (objc > 8 && chartColor(interp, objv[8], &fontcolor) != TCL_OK) ||
-        (objc > 9 && !(align = Tcl_GetStringFromObj(objv[9], 0))) ||
-        (objc > 10 && Tcl_GetDoubleFromObj(interp, objv[10], &angle) != TCL_OK) ||
-        (objc > 11 && Tcl_GetIntFromObj(interp, objv[11], &vertical) != TCL_OK)) {
-        Tcl_WrongNumArgs(interp, 2, objv, "#chart x y text ?font? ?fontsize? ?fontcolor? ?alignment? ?angle? ?vertical?");
+        if (!strcmp(name, "type") || !strcmp(name, "size"))
+            continue;
+        for (i = 0; chartSpecKeys[i].key && strcmp(chartSpecKeys[i].key, name); i++);
+        if (!chartSpecKeys[i].key) {
+            Tcl_AppendResult(interp, "unknown chart spec key \"", name, "\"", 0);
+            result = TCL_ERROR;
+            break;
+        }
+        if (!chartSpecKeys[i].multi) {
+            result = chartSpecCall(&chart, chartSpecKeys[i].proc, key, value, interp);
+            continue;
+        }
+        if ((result = Tcl_ListObjGetElements(interp, value, &argc, &argv)) != TCL_OK)
+            break;
+        for (int j = 0; result == TCL_OK && j < argc; j++)
+            result = chartSpecCall(&chart, chartSpecKeys[i].proc, key, argv[j], interp);
+    }
+    Tcl_DictObjDone(&search);
+    if (result != TCL_OK) {
+        chart.chart->destroy();
+        chartClear(&chart);
         return TCL_ERROR;
     }
-    chart->chart->addText(x, y, text, font, fontsize, fontcolor, chartAlignment(align, TopLeft), angle, vertical);
+    Tcl_ResetResult(interp);
+    if (!(image = cacheGet(&chart, &fmt))) {
+        if (renderAdmit(interp) != TCL_OK) {
+            chart.chart->destroy();
+            chartClear(&chart);
+            if (!conn)
+                return TCL_ERROR;
+            Tcl_ResetResult(interp);
+            Ns_ConnReturnUnavailable(conn);
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(0));
+            return TCL_OK;
+        }
+        image = imageEncode(&chart, &fmt, &mem);
+        renderRelease();
+    } else {
+        mem.data = image->data;
+        mem.len = image->len;
+    }
+
+    if (conn) {
+        int status = chartReturnData(conn, mem.data, mem.len, chartFormats[fmt.format].type);
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(status == NS_OK));
+    } else
+        Tcl_SetObjResult(interp, chartImageObj(image, &mem, &fmt, blob));
+    if (chart.chart)
+        chart.chart->destroy();
+    chartClear(&chart);
+    if (image)
+        releaseImage(image);
     return TCL_OK;
 }
 
-static int PieCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
+/*
+ * ns_chartdir blob size|type|return|write blob ?file?
+ *
+ * Works with image blobs returned by image -blob without copying, byte
+ * arrays are accepted as png images
+ */
+static int BlobCmd(int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
 {
-    int cmd;
-    enum commands {
-        cmdSetData, cmdSet3D,
-        cmdSetPieSize
-    };
+    int cmd, len, format = 0;
+    const char *data;
+    ChartImage *image;
+
+    enum commands { cmdSize, cmdType, cmdReturn, cmdWrite };
+    static const char *sCmd[] = { "size", "type", "return", "write", 0 };
 
-    static const char *sCmd[] = {
-        "setdata", "set3d",
-        "setpiesize",
-        0
-    };
-    if (chart->type != PieChartType) {
-        Tcl_AppendResult(interp, "wrong chart type", 0);
-        return TCL_ERROR;
-    }
     if (objc < 4) {
-        Tcl_WrongNumArgs(interp, 2, objv, "#chart cmd");
+        Tcl_WrongNumArgs(interp, 2, objv, "size|type|return|write blob ?file?");
         return TCL_ERROR;
     }
-    if (Tcl_GetIndexFromObj(interp, objv[3], sCmd, "command", TCL_EXACT, (int *) &cmd) != TCL_OK)
+    if (Tcl_GetIndexFromObj(interp, objv[2], sCmd, "command", TCL_EXACT, &cmd) != TCL_OK)
         return TCL_ERROR;
+    if (objv[3]->typePtr == &imageObjType) {
+        image = (ChartImage *) objv[3]->internalRep.otherValuePtr;
+        data = image->data;
+        len = image->len;
+        format = image->format;
+    } else
+        data = (const char *) Tcl_GetByteArrayFromObj(objv[3], &len);
 
     switch (cmd) {
-    case cmdSetData:{
-            char **labels = 0;
-            int argc, labelc;
-            Tcl_Obj **argv, **labelv;
+    case cmdSize:
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(len));
+        break;
 
-            if (objc < 5 ||
-                Tcl_ListObjGetElements(interp, objv[4], &argc, &argv) != TCL_OK ||
-                (objc > 5 && Tcl_ListObjGetElements(interp, objv[5], &labelc, &labelv) != TCL_OK)) {
-                Tcl_WrongNumArgs(interp, 4, objv, "data ?labels?");
-                return TCL_ERROR;
-            }
-            double *data = (double *) ns_malloc(argc * sizeof(double));
-            for (int i = 0; i < argc; i++)
-                Tcl_GetDoubleFromObj(interp, argv[i], &data[i]);
+    case cmdType:
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(chartFormats[format].type, -1));
+        break;
 
-            if (labelc > 0) {
-                labels = (char **) ns_malloc(labelc * sizeof(char *));
-                for (int i = 0; i < labelc; i++)
-                    labels[i] = Tcl_GetStringFromObj(labelv[i], 0);
+    case cmdReturn:{
+            Ns_Conn *conn = Ns_TclGetConn(interp);
+            if (conn == NULL) {
+                Tcl_AppendResult(interp, "no connection", NULL);
+                return TCL_ERROR;
             }
-            chart->pie->setData(argc, data, labels);
-            ns_free(data);
-            ns_free(labels);
+            int status = chartReturnData(conn, data, len, chartFormats[format].type);
+            Tcl_SetObjResult(interp, Tcl_NewIntObj(status == NS_OK));
+            break;
         }
 
-    case cmdSet3D:
-        chart->pie->set3D();
+    case cmdWrite:
+        if (objc < 5) {
+            Tcl_WrongNumArgs(interp, 3, objv, "blob file");
+            return TCL_ERROR;
+        }
+        if (chartWriteFile(Tcl_GetStringFromObj(objv[4], 0), data, len) != 0) {
+            Tcl_AppendResult(interp, Tcl_GetStringFromObj(objv[4], 0), ": ", Tcl_PosixError(interp), 0);
+            return TCL_ERROR;
+        }
         break;
+    }
+    return TCL_OK;
+}
 
-    case cmdSetPieSize:{
-            int x, y, r;
+/*
+ * ns_chartdir stats ?-reset?
+ *
+ * Returns module statistics as flat name value list, phase histograms are
+ * lists of bucket upper bound in microseconds and count
+ */
+static void statsAppend(Tcl_Interp * interp, Tcl_Obj * list, const char *name, Tcl_Obj * value)
+{
+    Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj(name, -1));
+    Tcl_ListObjAppendElement(interp, list, value);
+}
 
-            if (objc < 7 ||
-                Tcl_GetIntFromObj(interp, objv[4], &x) != TCL_OK ||
-                Tcl_GetIntFromObj(interp, objv[5], &y) != TCL_OK || Tcl_GetIntFromObj(interp, objv[6], &r) != TCL_OK) {
-                Tcl_WrongNumArgs(interp, 4, objv, "x y r");
-                return TCL_ERROR;
-            }
-            chart->pie->setPieSize(x, y, r);
+static int StatsCmd(int objc, Tcl_Obj * CONST objv[], Tcl_Interp * interp)
+{
+    int i, j, live = 0, pooled = 0, reset = 0;
+    char name[64];
+    Ns_Chart *chart;
+    Tcl_Obj *list, *hist;
+
+    if (objc > 2) {
+        if (strcmp(Tcl_GetStringFromObj(objv[2], 0), "-reset")) {
+            Tcl_WrongNumArgs(interp, 2, objv, "?-reset?");
+            return TCL_ERROR;
         }
+        reset = 1;
     }
+    for (i = 0; i < CHART_SHARDS; i++) {
+        Ns_MutexLock(&chartShards[i].lock);
+        live += chartShards[i].charts.numEntries;
+        Ns_MutexUnlock(&chartShards[i].lock);
+    }
+    Ns_MutexLock(&chartPoolMutex);
+    for (chart = chartPool; chart; chart = chart->next)
+        pooled++;
+    Ns_MutexUnlock(&chartPoolMutex);
+
+    list = Tcl_NewListObj(0, 0);
+    statsAppend(interp, list, "charts", Tcl_NewIntObj(live));
+    statsAppend(interp, list, "pooled", Tcl_NewIntObj(pooled));
+    statsAppend(interp, list, "memory", Tcl_NewWideIntObj(chartLoad(&chartMemory)));
+    statsAppend(interp, list, "evicted", Tcl_NewWideIntObj(chartLoad(&chartEvicted)));
+
+    Ns_MutexLock(&renderSlots.lock);
+    statsAppend(interp, list, "slots_busy", Tcl_NewIntObj(renderSlots.busy));
+    statsAppend(interp, list, "slots_waiting", Tcl_NewIntObj(renderSlots.waiters));
+    statsAppend(interp, list, "slots_rejected", Tcl_NewWideIntObj(renderSlots.rejected));
+    statsAppend(interp, list, "slots_timedout", Tcl_NewWideIntObj(renderSlots.timedout));
+    if (reset)
+        renderSlots.rejected = renderSlots.timedout = 0;
+    Ns_MutexUnlock(&renderSlots.lock);
+    statsAppend(interp, list, "images", Tcl_NewWideIntObj(chartLoad(&chartImages)));
+    statsAppend(interp, list, "bytes", Tcl_NewWideIntObj(chartLoad(&chartBytes)));
+    statsAppend(interp, list, "shard_busy", Tcl_NewWideIntObj(chartLoad(&chartShardBusy)));
+    statsAppend(interp, list, "lock_busy", Tcl_NewWideIntObj(chartLoad(&chartLockBusy)));
+
+    Ns_MutexLock(&chartMutex);
+    statsAppend(interp, list, "gc_passes", Tcl_NewWideIntObj(chartGCPasses));
+    statsAppend(interp, list, "gc_freed", Tcl_NewWideIntObj(chartGCFreed));
+    statsAppend(interp, list, "gc_pause", Ns_TclNewTimeObj(&chartGCLastPause));
+    if (reset)
+        chartGCPasses = chartGCFreed = 0;
+    Ns_MutexUnlock(&chartMutex);
+
+    Ns_MutexLock(&cacheMutex);
+    statsAppend(interp, list, "cache_size", Tcl_NewIntObj(cacheSize));
+    statsAppend(interp, list, "cache_hits", Tcl_NewWideIntObj(cacheHits));
+    statsAppend(interp, list, "cache_misses", Tcl_NewWideIntObj(cacheMisses));
+    if (reset)
+        cacheHits = cacheMisses = 0;
+    Ns_MutexUnlock(&cacheMutex);
+
+    Ns_MutexLock(&assetMutex);
+    statsAppend(interp, list, "asset_size", Tcl_NewIntObj(assetSize));
+    statsAppend(interp, list, "asset_hits", Tcl_NewWideIntObj(assetHits));
+    statsAppend(interp, list, "asset_loads", Tcl_NewWideIntObj(assetLoads));
+    if (reset)
+        assetHits = assetLoads = 0;
+    Ns_MutexUnlock(&assetMutex);
+
+    for (i = 0; i < PhaseCount; i++) {
+        snprintf(name, sizeof(name), "%s_count", chartPhases[i].name);
+        statsAppend(interp, list, name, Tcl_NewWideIntObj(chartLoad(&chartPhases[i].count)));
+        snprintf(name, sizeof(name), "%s_usec", chartPhases[i].name);
+        statsAppend(interp, list, name, Tcl_NewWideIntObj(chartLoad(&chartPhases[i].usec)));
+        snprintf(name, sizeof(name), "%s_max", chartPhases[i].name);
+        statsAppend(interp, list, name, Tcl_NewWideIntObj(chartLoad(&chartPhases[i].max)));
+        hist = Tcl_NewListObj(0, 0);
+        for (j = 0; j < CHART_HIST; j++) {
+            if (j < CHART_HIST - 1)
+                Tcl_ListObjAppendElement(interp, hist, Tcl_NewWideIntObj(1L << j));
+            else
+                Tcl_ListObjAppendElement(interp, hist, Tcl_NewStringObj("inf", -1));
+            Tcl_ListObjAppendElement(interp, hist, Tcl_NewWideIntObj(chartLoad(&chartPhases[i].hist[j])));
+        }
+        snprintf(name, sizeof(name), "%s_hist", chartPhases[i].name);
+        statsAppend(interp, list, name, hist);
+    }
+    if (reset) {
+        chartStore(&chartImages, 0UL);
+        chartStore(&chartEvicted, 0UL);
+        chartStore(&chartBytes, 0UL);
+        chartStore(&chartShardBusy, 0UL);
+        chartStore(&chartLockBusy, 0UL);
+        for (i = 0; i < PhaseCount; i++) {
+            chartStore(&chartPhases[i].count, 0UL);
+            chartStore(&chartPhases[i].usec, 0UL);
+            chartStore(&chartPhases[i].max, 0UL);
+            for (j = 0; j < CHART_HIST; j++)
+                chartStore(&chartPhases[i].hist[j], 0UL);
+        }
+    }
+    Tcl_SetObjResult(interp, list);
     return TCL_OK;
 }
 
@@ -1422,11 +5017,18 @@ static int PieCmd(Ns_Chart * chart, int objc, Tcl_Obj * CONST objv[], Tcl_Interp
 static int ChartCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONST objv[])
 {
     int i, cmd;
+    int result = TCL_OK;
     Ns_Chart *chart = 0;
+    ChartInterp *data = (ChartInterp *) arg;
+    Ns_Time start;
 
     enum commands {
         cmdGc, cmdCharts,
-        cmdVersion,
+        cmdVersion, cmdRender,
+        cmdPool, cmdTemplate,
+        cmdBlob, cmdSchedule,
+        cmdRenderBatch, cmdComposite,
+        cmdStats,
         cmdNoValue, cmdTransparentColor,
         cmdPaletteColor, cmdLineColor,
         cmdTextColor, cmdDataColor,
@@ -1447,7 +5049,11 @@ static int ChartCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CON
 
     static const char *sCmd[] = {
         "gc", "charts",
-        "version",
+        "version", "render",
+        "pool", "template",
+        "blob", "schedule",
+        "renderbatch", "composite",
+        "stats",
         "novalue", "transparentcolor",
         "palettecolor", "linecolor",
         "textcolor", "datacolor",
@@ -1471,6 +5077,7 @@ static int ChartCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CON
         Tcl_WrongNumArgs(interp, 1, objv, "command ...");
         return TCL_ERROR;
     }
+    chartPhaseStart(&start);
     if (Tcl_GetIndexFromObj(interp, objv[1], sCmd, "command", TCL_EXACT, (int *) &cmd) != TCL_OK)
         return TCL_ERROR;
 
@@ -1479,114 +5086,283 @@ static int ChartCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CON
             Tcl_WrongNumArgs(interp, 1, objv, "command #chart ...");
             return TCL_ERROR;
         }
-        if (Tcl_GetIntFromObj(interp, objv[2], &i) != TCL_OK)
-            return TCL_ERROR;
-        if (!(chart = getChart(i))) {
-            Tcl_AppendResult(interp, "Invalid or expired chart object", 0);
+        if (!(chart = chartFromObj(data, objv[2], interp)))
             return TCL_ERROR;
+        /* Chart stays pinned and locked until the command completes */
+        chartLock(&chart->lock, &chartLockBusy);
+        /* Every command which changes the chart goes into its spec hash */
+        if (cmd != cmdSave && cmd != cmdDestroy && cmd != cmdImage && cmd != cmdReturn) {
+            chartHashObjs(chart, 1, objv + 1);
+            chartHashObjs(chart, objc - 3, objv + 3);
         }
-        chart->access_time = time(0);
     }
+    /* Dispatch is the command and chart lookup, chart commands only */
+    if (cmd >= cmdCreate)
+        chartPhaseEnd(PhaseDispatch, &start);
 
     switch (cmd) {
     case cmdVersion:
         Tcl_AppendResult(interp, "ns_chartdir ", _VERSION, 0);
         break;
 
+    case cmdRender:
+        if (objc < 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "spec ?-format png|jpg|gif|bmp|wbmp|svg? ?-quality n? ?-blob? ?-return?");
+            return TCL_ERROR;
+        }
+        return renderChart(objv[2], objc - 3, objv + 3, interp);
+
+    case cmdTemplate:
+        return TemplateCmd(data, objc, objv, interp);
+
+    case cmdBlob:
+        return BlobCmd(objc, objv, interp);
+
+    case cmdSchedule:
+        return ScheduleCmd(objc, objv, interp);
+
+    case cmdRenderBatch:
+        return RenderBatchCmd(data, objc, objv, interp);
+
+    case cmdComposite:
+        return CompositeCmd(data, objc, objv, interp);
+
+    case cmdStats:
+        return StatsCmd(objc, objv, interp);
+
+    case cmdPool:{
+            // Render pool statistics
+            Tcl_Obj *list = Tcl_NewListObj(0, 0);
+
+            Ns_MutexLock(&renderPool.lock);
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj("threads", -1));
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewIntObj(renderPool.threads));
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj("queued", -1));
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewIntObj(renderPool.queued));
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj("jobs", -1));
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewWideIntObj(renderPool.jobs));
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj("waittime", -1));
+            Tcl_ListObjAppendElement(interp, list, Ns_TclNewTimeObj(&renderPool.waittime));
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj("maxwait", -1));
+            Tcl_ListObjAppendElement(interp, list, Ns_TclNewTimeObj(&renderPool.maxwait));
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj("rendertime", -1));
+            Tcl_ListObjAppendElement(interp, list, Ns_TclNewTimeObj(&renderPool.rendertime));
+            Tcl_ListObjAppendElement(interp, list, Tcl_NewStringObj("maxrender", -1));
+            Tcl_ListObjAppendElement(interp, list, Ns_TclNewTimeObj(&renderPool.maxrender));
+            Ns_MutexUnlock(&renderPool.lock);
+            Tcl_SetObjResult(interp, list);
+            break;
+        }
+
     case cmdGc:
-        ChartGC(0);
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(chartCollect()));
         break;
 
     case cmdCharts:{
             // Lists charts in memory
             Tcl_Obj *list = Tcl_NewListObj(0, 0);
-            Ns_MutexLock(&chartMutex);
-            for (chart = chartList; chart; chart = chart->next) {
-                Tcl_ListObjAppendElement(interp, list, Tcl_NewIntObj(chart->id));
-                Tcl_ListObjAppendElement(interp, list, Tcl_NewIntObj(chart->access_time));
+            Tcl_HashEntry *hPtr;
+            Tcl_HashSearch search;
+
+            for (i = 0; i < CHART_SHARDS; i++) {
+                Ns_MutexLock(&chartShards[i].lock);
+                for (hPtr = Tcl_FirstHashEntry(&chartShards[i].charts, &search); hPtr; hPtr = Tcl_NextHashEntry(&search)) {
+                    Ns_Chart *entry = (Ns_Chart *) Tcl_GetHashValue(hPtr);
+                    Tcl_ListObjAppendElement(interp, list, Tcl_NewLongObj(entry->id));
+                    Tcl_ListObjAppendElement(interp, list, Tcl_NewIntObj(chartLoad(&entry->access_time)));
+                }
+                Ns_MutexUnlock(&chartShards[i].lock);
             }
-            Ns_MutexUnlock(&chartMutex);
             Tcl_SetObjResult(interp, list);
             return TCL_OK;
         }
 
     case cmdCreate:
-        if (!createChart(objc, objv, interp))
+        if (createChart(data, objc, objv, interp) != TCL_OK)
             return TCL_ERROR;
         break;
 
     case cmdSetBackground:
-        return setBackground(chart, objc, objv, interp);
+        result = setBackground(chart, objc, objv, interp);
+        break;
 
     case cmdSetPlotArea:
-        return setPlotArea(chart, objc, objv, interp);
+        result = setPlotArea(chart, objc, objv, interp);
+        break;
 
     case cmdAddLegend:
-        return addLegend(chart, objc, objv, interp);
+        result = addLegend(chart, objc, objv, interp);
+        break;
 
     case cmdAddTitle:
-        return addTitle(chart, objc, objv, interp);
+        result = addTitle(chart, objc, objv, interp);
+        break;
 
     case cmdAddText:
-        return addText(chart, objc, objv, interp);
+        result = addText(chart, objc, objv, interp);
+        break;
 
     case cmdSetSize:
-        return setSize(chart, objc, objv, interp);
+        result = setSize(chart, objc, objv, interp);
+        break;
 
     case cmdPie:
-        return PieCmd(chart, objc, objv, interp);
+        result = PieCmd(chart, objc, objv, interp);
+        break;
 
     case cmdSetColors:
-        return setColors(chart, objc, objv, interp);
+        result = setColors(chart, objc, objv, interp);
+        break;
 
     case cmdSetBgImage:
-        return setBgImage(chart, objc, objv, interp);
+        result = setBgImage(chart, objc, objv, interp);
+        break;
 
     case cmdSetWallpaper:
-        return setWallpaper(chart, objc, objv, interp);
+        result = setWallpaper(chart, objc, objv, interp);
+        break;
 
     case cmdYAxis:
-        return YAxisCmd(0, chart, objc, objv, interp);
+        result = YAxisCmd(0, chart, objc, objv, interp);
+        break;
 
     case cmdXAxis:
-        return XAxisCmd(0, chart, objc, objv, interp);
+        result = XAxisCmd(0, chart, objc, objv, interp);
+        break;
 
     case cmdYAxis2:
-        return YAxisCmd(1, chart, objc, objv, interp);
+        result = YAxisCmd(1, chart, objc, objv, interp);
+        break;
 
     case cmdXAxis2:
-        return XAxisCmd(1, chart, objc, objv, interp);
+        result = XAxisCmd(1, chart, objc, objv, interp);
+        break;
 
     case cmdLayer:
-        return LayerCmd(chart, objc, objv, interp);
-
-    case cmdSave:
-        chart->chart->makeChart(Tcl_GetStringFromObj(objv[3], 0));
+        result = LayerCmd(chart, objc, objv, interp);
         break;
 
+    case cmdSave:{
+            ChartFormat fmt = { -1, 0 };
+            MemBlock mem;
+            ChartImage *image;
+            char *file;
+            int rc = 0, async = 0;
+
+            if (objc < 4) {
+                Tcl_WrongNumArgs(interp, 2, objv, "#chart file ?-async? ?-format format? ?-quality n?");
+                result = TCL_ERROR;
+                break;
+            }
+            for (i = 4; i < objc; i++) {
+                if ((rc = chartFormatOption(interp, objc, objv, &i, &fmt)) > 0)
+                    continue;
+                if (rc == 0 && !strcmp(Tcl_GetStringFromObj(objv[i], 0), "-async")) {
+                    async = 1;
+                    continue;
+                }
+                if (!rc)
+                    Tcl_AppendResult(interp, "wrong option: should be -async, -format or -quality", 0);
+                result = TCL_ERROR;
+                break;
+            }
+            if (result != TCL_OK)
+                break;
+            file = Tcl_GetStringFromObj(objv[3], 0);
+            /* Without -format it is taken from the file extension */
+            if (fmt.format < 0)
+                chartFileFormat(file, &fmt);
+            if (async && chartSaveAsync(chart, file, &fmt))
+                break;
+            if (chartRender(chart, &fmt, &mem, &image, interp) != TCL_OK) {
+                result = TCL_ERROR;
+                break;
+            }
+            if (chartWriteFile(file, mem.data, mem.len) != 0) {
+                Tcl_AppendResult(interp, file, ": ", Tcl_PosixError(interp), 0);
+                result = TCL_ERROR;
+            }
+            if (image)
+                releaseImage(image);
+            break;
+        }
+
     case cmdImage:{
-            MemBlock mem = chart->chart->makeChart(PNG);
-            Tcl_Obj *result = Tcl_NewByteArrayObj((unsigned char *) mem.data, mem.len);
-            if (result == NULL)
-                return TCL_ERROR;
-            Tcl_SetObjResult(interp, result);
+            MemBlock mem;
+            ChartFormat fmt = { 0, 0 };
+            int rc = 0, blob = 0;
+
+            for (i = 3; i < objc; i++) {
+                if ((rc = chartFormatOption(interp, objc, objv, &i, &fmt)) > 0)
+                    continue;
+                if (rc == 0 && !strcmp(Tcl_GetStringFromObj(objv[i], 0), "-blob")) {
+                    blob = 1;
+                    continue;
+                }
+                if (!rc)
+                    Tcl_AppendResult(interp, "wrong option: should be -blob, -format or -quality", 0);
+                result = TCL_ERROR;
+                break;
+            }
+            if (result != TCL_OK)
+                break;
+            ChartImage *image;
+            if (chartRender(chart, &fmt, &mem, &image, interp) != TCL_OK) {
+                result = TCL_ERROR;
+                break;
+            }
+            Tcl_SetObjResult(interp, chartImageObj(image, &mem, &fmt, blob));
+            if (image)
+                releaseImage(image);
             break;
         }
 
     case cmdReturn:{
-            MemBlock mem = chart->chart->makeChart(PNG);
             Ns_Conn *conn = Ns_TclGetConn(interp);
+            ChartFormat fmt = { 0, 0 };
+            int rc = 0, async = 0;
+
             if (conn == NULL) {
                 Tcl_AppendResult(interp, "no connection", NULL);
-                return TCL_ERROR;
+                result = TCL_ERROR;
+                break;
+            }
+            for (i = 3; i < objc; i++) {
+                if ((rc = chartFormatOption(interp, objc, objv, &i, &fmt)) > 0)
+                    continue;
+                if (rc == 0 && !strcmp(Tcl_GetStringFromObj(objv[i], 0), "-async")) {
+                    async = 1;
+                    continue;
+                }
+                if (!rc)
+                    Tcl_AppendResult(interp, "wrong option: should be -async, -format or -quality", 0);
+                result = TCL_ERROR;
+                break;
+            }
+            if (result != TCL_OK)
+                break;
+            if (async && chartReturnAsync(chart, &fmt, interp)) {
+                Tcl_AppendResult(interp, "1", NULL);
+                break;
+            }
+            MemBlock mem;
+            ChartImage *image;
+            /* Overloaded, client gets 503 at once */
+            if (chartRender(chart, &fmt, &mem, &image, interp) != TCL_OK) {
+                Tcl_ResetResult(interp);
+                Ns_ConnReturnUnavailable(conn);
+                Tcl_AppendResult(interp, "0", NULL);
+                break;
             }
-            int status = Ns_ConnReturnData(conn, 200, (char *) mem.data, mem.len, "image/png");
+            int status = chartReturnData(conn, mem.data, mem.len, chartFormats[fmt.format].type);
+            if (image)
+                releaseImage(image);
             Tcl_AppendResult(interp, status == NS_OK ? "1" : "0", NULL);
             break;
         }
 
     case cmdDestroy:
-        freeChart(chart, 1);
+        freeChart(chart);
         break;
 
     case cmdNoValue:
@@ -1622,15 +5398,26 @@ static int ChartCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CON
         break;
 
     case cmdDashLineColor:
-        return dashLineColor(chart, objc, objv, interp);
+        result = dashLineColor(chart, objc, objv, interp);
+        break;
 
     case cmdPatternColor:
-        return patternColor(chart, objc, objv, interp);
+        result = patternColor(chart, objc, objv, interp);
+        break;
 
     case cmdGradientColor:
-        return gradientColor(chart, objc, objv, interp);
+        result = gradientColor(chart, objc, objv, interp);
+        break;
     }
-    return TCL_OK;
+    if (chart) {
+        if (chart->recording && result == TCL_OK)
+            templateRecord(chart->recording, objc, objv);
+        Ns_MutexUnlock(&chart->lock);
+        releaseChart(chart);
+        if (chartOverBudget())
+            chartEvict();
+    }
+    return result;
 }
 
 
@@ -0,0 +1,42 @@
+# Checks ns_chartdir return -async with a slow reader, run it from nscp
+# with render_threads greater than 0. Large bmp image does not fit into
+# socket buffers, so the rest is sent by the ns_connchan callback while
+# the client reads in small chunks. Body must match Content-Length.
+
+ns_register_proc GET /nschartdir-async {
+    set chart [ns_chartdir create xy 1200 1200]
+    ns_chartdir layer $chart create line {1 5 2 4 3}
+    ns_chartdir return $chart -async -format bmp
+    ns_chartdir destroy $chart
+}
+
+set port [ns_config ns/server/[ns_info server]/module/nssock port]
+if { $port eq "" } {
+    set port [ns_config ns/module/nssock port 8080]
+}
+
+set sock [socket localhost $port]
+fconfigure $sock -translation binary -buffering full
+puts -nonewline $sock "GET /nschartdir-async HTTP/1.0\r\nHost: localhost\r\n\r\n"
+flush $sock
+
+set length -1
+set status [string trim [gets $sock]]
+while { [set line [string trim [gets $sock]]] ne "" } {
+    regexp -nocase {^content-length:\s*(\d+)} $line - length
+}
+set size 0
+while { ![eof $sock] } {
+    incr size [string length [read $sock 4096]]
+    after 5
+}
+close $sock
+ns_unregister_op GET /nschartdir-async
+
+if { ![string match "HTTP/1.? 200*" $status] } {
+    ns_log error "ns_chartdir: async return: $status"
+} elseif { $length <= 0 || $length != $size } {
+    ns_log error "ns_chartdir: async return: Content-Length $length, received $size bytes"
+} else {
+    ns_log notice "ns_chartdir: async return: $size bytes received"
+}
@@ -0,0 +1,36 @@
+# Checks the image cache, run it from nscp with cache_size greater than 0.
+# Render spec with an image file must be found in the cache when rendered
+# again.
+
+set spec {
+    type xy
+    size {200 100}
+    bgimage {bg.png}
+    layers {{create line {1 2 3 4 5}}}
+}
+
+array set stats [ns_chartdir stats]
+set hits $stats(cache_hits)
+ns_chartdir render $spec
+ns_chartdir render $spec
+array set stats [ns_chartdir stats]
+if { $stats(cache_hits) <= $hits } {
+    ns_log error "ns_chartdir: render spec with bgimage was not found in the cache"
+}
+
+# Data followed by name and data with the name appended must not share
+# the cache entry
+set bytes [binary format d* {1 2 3 4 5}]
+set longer [binary format d*a8 {1 2 3 4 5} ABCDEFGH]
+array set stats [ns_chartdir stats]
+set hits $stats(cache_hits)
+foreach { data name } [list $bytes ABCDEFGH $longer ""] {
+    set chart [ns_chartdir create xy 200 100]
+    ns_chartdir layer $chart create -binary float64 line $data $name
+    ns_chartdir image $chart
+    ns_chartdir destroy $chart
+}
+array set stats [ns_chartdir stats]
+if { $stats(cache_hits) != $hits } {
+    ns_log error "ns_chartdir: different charts were served the same cached image"
+}
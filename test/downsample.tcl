@@ -0,0 +1,33 @@
+# Checks that datasets of a downsampled layer stay at the layer x
+# positions, run it from nscp. Datasets which would be placed elsewhere
+# must fail with NSCHARTDIR DOWNSAMPLE error code.
+
+set long {}
+set short {}
+for { set i 0 } { $i < 1000 } { incr i } {
+    lappend long [expr {sin($i / 10.0)}]
+}
+for { set i 0 } { $i < 500 } { incr i } {
+    lappend short $i
+}
+
+set chart [ns_chartdir create xy 200 100]
+ns_chartdir layer $chart create -downsample lttb -target 100 line $long
+set plain [ns_chartdir layer $chart create line $short]
+
+foreach { args ok } [list \
+    [list -downsample lttb -target 100 0 $long] 1 \
+    [list 0 $long] 1 \
+    [list -downsample avg -target 100 0 $long] 0 \
+    [list -downsample lttb -target 50 0 $long] 0 \
+    [list 0 $short] 0 \
+    [list -downsample lttb -target 100 $plain $long] 0] {
+    set rc [catch { eval [list ns_chartdir layer $chart dataset] $args } msg]
+    if { $ok && $rc } {
+        ns_log error "ns_chartdir: dataset [lrange $args 0 end-1] failed: $msg"
+    }
+    if { !$ok && (!$rc || [lrange $::errorCode 0 1] ne "NSCHARTDIR DOWNSAMPLE") } {
+        ns_log error "ns_chartdir: dataset [lrange $args 0 end-1] was accepted"
+    }
+}
+ns_chartdir destroy $chart
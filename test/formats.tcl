@@ -0,0 +1,26 @@
+# Compares encode time and image size of output formats on the chart from
+# render.tcl, run it from nscp. setsize is called before every image so
+# the chart hash changes and the image cache is never hit.
+
+source render.tcl
+
+ns_chartdir template define formats $spec
+set chart [ns_chartdir create -template formats]
+
+foreach {format options} {
+    png {}
+    gif {}
+    bmp {}
+    jpg {-quality 90}
+    jpg {-quality 50}
+    svg {}
+} {
+    set usec [lindex [time {
+        ns_chartdir setsize $chart 500 300
+        set image [eval [list ns_chartdir image $chart -format $format] $options]
+    } 100] 0]
+    ns_log notice "ns_chartdir: $format $options: $usec usec/image, [string length $image] bytes"
+}
+
+ns_chartdir destroy $chart
+ns_chartdir template delete formats
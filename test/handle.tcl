@@ -0,0 +1,29 @@
+# Measures per call dispatch overhead of chart handles, run it from nscp.
+# The handle returned by create resolves the chart without registry
+# lookup, a freshly formatted id has to go through the registry.
+
+set chart [ns_chartdir create xy 100 100]
+
+set usec [lindex [time { ns_chartdir setsize $chart 100 100 } 100000] 0]
+ns_log notice "ns_chartdir: cached handle: $usec usec/call"
+
+set usec [lindex [time { ns_chartdir setsize [format %d $chart] 100 100 } 100000] 0]
+ns_log notice "ns_chartdir: chart id: $usec usec/call"
+
+# Stale handle must be detected after destroy
+set handle $chart
+ns_chartdir destroy $chart
+if { ![catch { ns_chartdir setsize $handle 100 100 }] } {
+    ns_log error "ns_chartdir: stale handle was accepted"
+}
+
+# Handle to a global chart destroyed while another thread keeps it pinned
+# must fail the same way
+set chart [ns_chartdir create -scope global xy 1200 1200]
+ns_chartdir layer $chart create line {1 5 2 4 3}
+set tid [ns_thread begin "ns_chartdir image $chart -format bmp"]
+ns_chartdir destroy $chart
+if { ![catch { ns_chartdir setsize $chart 100 100 } error] || ![string match "*expired*" $error] } {
+    ns_log error "ns_chartdir: handle to pinned destroyed chart was accepted"
+}
+ns_thread wait $tid
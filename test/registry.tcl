@@ -0,0 +1,19 @@
+# Measures cost of chart lookup as the number of live charts grows,
+# run it from nscp. Each step creates more charts and times a cheap
+# subcommand on the first one, cost per call should stay flat.
+
+set charts {}
+set first [ns_chartdir create xy 100 100]
+
+foreach count {100 1000 10000 50000} {
+    while { [llength $charts] < $count } {
+        lappend charts [ns_chartdir create xy 100 100]
+    }
+    set usec [lindex [time { ns_chartdir setsize $first 100 100 } 10000] 0]
+    ns_log notice "ns_chartdir: $count charts: lookup $usec usec/call"
+}
+
+foreach chart $charts {
+    ns_chartdir destroy $chart
+}
+ns_chartdir destroy $first
@@ -0,0 +1,25 @@
+# Same chart as multiline.tcl built with a single ns_chartdir render call
+
+set data0 {42 49 33 38 51 46 29 41 44 57 59 52 37 34 51 56 56 60 70 76 63 67 75 64 51}
+set data1 {50 55 47 34 42 49 63 62 73 59 56 50 64 60 67 67 58 59 73 77 84 82 80 84 98}
+set data2 {36 28 25 33 38 20 22 30 25 33 30 24 28 15 21 26 46 42 48 45 43 52 64 60 70}
+
+set labels {"0" "" "" "3" "" "" "6" "" "" "9" "" "" "12" "" "" "15" "" "" "18" "" "" "21" "" "" "24"}
+
+set spec [dict create \
+    type xy \
+    size {500 300 0xffff80 0 1} \
+    plotarea {55 45 420 210 0xffffff -1 -1 0xc0c0c0 -1} \
+    legend {55 25 0 Transparent Transparent "" 8 TextColor} \
+    titles {{"Daily Server Load" Top "" 11 0xffffff 0x800000 -1 1}} \
+    yaxis {{settitle "MBytes"}} \
+    xaxis [list [list setlabels $labels] {settitle "Jun 12, 2001"}] \
+    layers [list [list create line $data0 "Server # 1"] \
+                 [list dataset 0 $data1 "Server # 2"] \
+                 [list dataset 0 $data2 "Server # 3"] \
+                 {setlinewidth 0 3}]]
+
+set fd [open render.png w]
+fconfigure $fd -translation binary
+puts -nonewline $fd [ns_chartdir render $spec -format png]
+close $fd